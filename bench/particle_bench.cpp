@@ -0,0 +1,335 @@
+// Microbenchmarks for the particle hot paths, swept over pool sizes and alive
+// fractions. Results go to stdout (or --out) as a JSON array, one object per
+// measurement.
+// usage: bench [--sizes 10000,100000,...] [--fractions 0.1,0.5,...] [--threads N] [--out file]
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "particle_system.h"
+#include "particle_update.h"
+
+// a measurement is repeated until it has run this long, and at least 3 times
+static const double MIN_SECONDS = 0.25;
+
+struct Measurement {
+    std::string name;
+    int capacity;
+    double alive_fraction;
+    int particles;     // particles processed per iteration
+    int iterations;
+    double best_ns;    // fastest iteration, per particle
+    double mean_ns;    // mean iteration, per particle
+};
+
+static std::vector<double> parseList(const char *text) {
+    std::vector<double> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        values.push_back(atof(item.c_str()));
+    return values;
+}
+
+static unsigned int bench_state = 2463534242u;
+
+static float nextUnit() {
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 17;
+    bench_state ^= bench_state << 5;
+    return (float)(bench_state >> 8) / (float)(1 << 24);
+}
+
+// fills the first count slots with particles that outlive any benchmark
+static void fillStore(ParticleStore &p, int count) {
+    for (int i = 0; i < count; i++) {
+        int slot = p.spawn();
+        p.pos_x[slot] = nextUnit() * 20.0f - 10.0f;
+        p.pos_y[slot] = nextUnit() * 20.0f - 10.0f;
+        p.pos_z[slot] = nextUnit() * 20.0f - 10.0f;
+        p.vel_x[slot] = nextUnit() * 10.0f - 5.0f;
+        p.vel_y[slot] = nextUnit() * 10.0f - 5.0f;
+        p.vel_z[slot] = nextUnit() * 10.0f - 5.0f;
+        p.life[slot] = 1.0e6f;
+        p.weight[slot] = 1.0f;
+    }
+}
+
+// empties the pool and fills count slots again as fillStore does, leaving a
+// dying share of them, spread at random, less than one step of life
+static void refillStore(ParticleStore &p, int count, float dying, float step) {
+    while (p.alive_count > 0)
+        p.kill(p.alive_count - 1);
+    fillStore(p, count);
+    for (int i = 0; i < count; i++) {
+        if (nextUnit() < dying)
+            p.life[i] = 0.5f * step;
+    }
+}
+
+// lays the first count slots out as water at rest: a jittered cube lattice at
+// the rest spacing of the fluid
+static void fillFluid(ParticleStore &p, int count, const SphParams &params) {
+    float spacing = std::cbrt(params.mass / params.rest_density);
+    int side = (int)std::ceil(std::cbrt((double)count));
+    for (int i = 0; i < count; i++) {
+        p.pos_x[i] = ((i % side) + 0.1f * nextUnit()) * spacing;
+        p.pos_y[i] = ((i / side % side) + 0.1f * nextUnit()) * spacing;
+        p.pos_z[i] = ((i / side / side) + 0.1f * nextUnit()) * spacing;
+    }
+}
+
+// runs setup (untimed) then body (timed) until MIN_SECONDS have been spent in body
+template <typename Setup, typename Body>
+static Measurement measure(const std::string &name, int capacity, double fraction, int particles,
+                           Setup setup, Body body) {
+    Measurement m = {name, capacity, fraction, particles, 0, 1e300, 0.0};
+    double total = 0.0;
+    while (m.iterations < 3 || total < MIN_SECONDS) {
+        setup();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        total += elapsed.count();
+        m.iterations++;
+        m.best_ns = std::min(m.best_ns, elapsed.count() * 1e9 / std::max(particles, 1));
+    }
+    m.mean_ns = total * 1e9 / std::max(particles, 1) / m.iterations;
+    return m;
+}
+
+static void writeJson(std::ostream &out, const std::vector<Measurement> &results,
+                      const char *kernel, int threads) {
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Measurement &m = results[i];
+        out << "  {\"benchmark\": \"" << m.name << "\""
+            << ", \"kernel\": \"" << kernel << "\""
+            << ", \"threads\": " << threads
+            << ", \"capacity\": " << m.capacity
+            << ", \"alive_fraction\": " << m.alive_fraction
+            << ", \"particles\": " << m.particles
+            << ", \"iterations\": " << m.iterations
+            << ", \"ns_per_particle\": " << m.mean_ns
+            << ", \"best_ns_per_particle\": " << m.best_ns
+            << ", \"particles_per_second\": " << (m.mean_ns > 0.0 ? 1e9 / m.mean_ns : 0.0)
+            << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::vector<double> sizes = parseList("10000,100000,1000000,3000000");
+    std::vector<double> fractions = parseList("0.1,0.5,1.0");
+    int threads = 0;
+    const char *out_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--sizes") == 0 && has_value)
+            sizes = parseList(argv[++i]);
+        else if (std::strcmp(argv[i], "--fractions") == 0 && has_value)
+            fractions = parseList(argv[++i]);
+        else if (std::strcmp(argv[i], "--threads") == 0 && has_value)
+            threads = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--out") == 0 && has_value)
+            out_path = argv[++i];
+        else {
+            std::cerr << "usage: bench [--sizes N,N,...] [--fractions F,F,...] [--threads N] [--out file]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Measurement> results;
+    const char *kernel_name = selectIntegrateKernel().name;
+    int pool_size = 1;
+    for (size_t s = 0; s < sizes.size(); s++) {
+        const int capacity = (int)sizes[s];
+        // one system per size; its pool and kernel serve every benchmark
+        ParticleSystem system(capacity, threads);
+        pool_size = system.pool.size();
+        ParticleStore &particles = system.particles;
+        std::vector<float> out(3 * (size_t)capacity);
+        std::vector<int> dead(capacity);
+        StepParams params = {system.timestep.step, 0.0f, -9.81f, 0.0f, 0.0f, 0.0f};
+
+        for (size_t f = 0; f < fractions.size(); f++) {
+            const double fraction = fractions[f];
+            const int alive = std::max(1, std::min(capacity, (int)(capacity * fraction)));
+            std::cerr << "capacity " << capacity << ", alive " << alive << std::endl;
+
+            // start every benchmark from the same alive range
+            while (particles.alive_count > 0)
+                particles.kill(particles.alive_count - 1);
+            fillStore(particles, alive);
+
+            // spawn into the free part of the pool, up to 100k per iteration
+            const int spawn_count = std::min(capacity - alive, 100000);
+            if (spawn_count > 0) {
+                glm::vec3 position(9.0f, 1.5f, 0.0f), velocity(5.0f, 1.0f, 0.0f);
+                results.push_back(measure("spawn", capacity, fraction, spawn_count,
+                    [&] {
+                        while (particles.alive_count > alive)
+                            particles.kill(particles.alive_count - 1);
+                    },
+                    [&] {
+                        for (int i = 0; i < spawn_count; i++)
+                            system.spawn(position, velocity, 1.0e6f);
+                    }));
+                while (particles.alive_count > alive)
+                    particles.kill(particles.alive_count - 1);
+            }
+
+            // gravity integration alone, one thread
+            results.push_back(measure("update", capacity, fraction, alive, [] {},
+                [&] { system.kernel.run(particles, 0, alive, params, NULL, &dead[0]); }));
+
+            // integration plus compaction into the position buffer, one thread.
+            // a share of the particles dies in the timed step, so the kills and
+            // the compaction around them are part of it
+            const float dying = 0.1f;
+            results.push_back(measure("update_compact", capacity, fraction, alive,
+                [&] { refillStore(particles, alive, dying, params.dt); },
+                [&] {
+                    IntegrateResult r = system.kernel.run(particles, 0, alive, params, &out[0], &dead[0]);
+                    particles.removeDead(&dead[0], r.dead);
+                }));
+
+            // the same across the pool
+            results.push_back(measure("update_compact_parallel", capacity, fraction, alive,
+                [&] { refillStore(particles, alive, dying, params.dt); },
+                [&] {
+                    IntegrateResult r = integrateParallel(system.pool, system.kernel, particles, params, &out[0], &dead[0]);
+                    particles.removeDead(&dead[0], r.dead);
+                }));
+            refillStore(particles, alive, 0.0f, params.dt);
+
+            // back to front sort of the live particles, seen from a new camera
+            // around the box every time
+            {
+                DepthSort sorter;
+                sorter.coherence_limit = 0.0f;
+                float eye[3], forward[3];
+                results.push_back(measure("sort", capacity, fraction, alive,
+                    [&] {
+                        float angle = nextUnit() * 6.2831853f;
+                        eye[0] = 30.0f * std::cos(angle);
+                        eye[1] = 5.0f;
+                        eye[2] = 30.0f * std::sin(angle);
+                        for (int k = 0; k < 3; k++)
+                            forward[k] = -eye[k] / std::sqrt(925.0f);
+                    },
+                    [&] { sorter.sort(system.pool, particles, 0.0f, eye, forward, &out[0]); }));
+            }
+
+            // back to front order of the instance buffer: from scratch, repaired
+            // from the last order for a camera that holds still while nothing
+            // moves, while 1% of the particles jump, while all of them drift by
+            // less than their depth spacing and while the camera orbits as
+            // slowly, and by 2048 slices of depth
+            {
+                DepthSort scratch, still, nudged, drifting, orbiting, buckets;
+                scratch.coherence_limit = 0.0f;
+                buckets.mode = DEPTH_SORT_BUCKETS;
+                const float eye[3] = {0.0f, 5.0f, 30.0f}, forward[3] = {0.0f, 0.0f, -1.0f};
+                const float spacing = 20.0f / alive;
+                results.push_back(measure("depth_sort", capacity, fraction, alive, [] {},
+                    [&] { scratch.sort(system.pool, particles, 0.0f, eye, forward, &out[0]); }));
+                still.sort(system.pool, particles, 0.0f, eye, forward, &out[0]);
+                results.push_back(measure("depth_sort_static", capacity, fraction, alive, [] {},
+                    [&] { still.sort(system.pool, particles, 0.0f, eye, forward, &out[0]); }));
+                nudged.sort(system.pool, particles, 0.0f, eye, forward, &out[0]);
+                results.push_back(measure("depth_sort_static_moving", capacity, fraction, alive,
+                    [&] {
+                        for (int i = 0; i < alive / 100; i++)
+                            particles.pos_z[(int)(nextUnit() * alive) % alive] += 0.02f * nextUnit() - 0.01f;
+                    },
+                    [&] { nudged.sort(system.pool, particles, 0.0f, eye, forward, &out[0]); }));
+                // back and forth, so the particles stay in the box
+                float drift = 0.1f * spacing;
+                drifting.sort(system.pool, particles, 0.0f, eye, forward, &out[0]);
+                results.push_back(measure("depth_sort_drift", capacity, fraction, alive,
+                    [&] {
+                        drift = -drift;
+                        for (int i = 0; i < alive; i++) {
+                            particles.pos_x[i] += drift * particles.vel_x[i];
+                            particles.pos_y[i] += drift * particles.vel_y[i];
+                            particles.pos_z[i] += drift * particles.vel_z[i];
+                        }
+                    },
+                    [&] { drifting.sort(system.pool, particles, 0.0f, eye, forward, &out[0]); }));
+                float angle = 0.0f, orbit_eye[3] = {0.0f, 5.0f, 30.0f}, orbit_forward[3] = {0.0f, 0.0f, -1.0f};
+                orbiting.sort(system.pool, particles, 0.0f, orbit_eye, orbit_forward, &out[0]);
+                results.push_back(measure("depth_sort_orbit", capacity, fraction, alive,
+                    [&] {
+                        angle += 0.02f * spacing;
+                        orbit_eye[0] = 30.0f * std::sin(angle);
+                        orbit_eye[2] = 30.0f * std::cos(angle);
+                        orbit_forward[0] = -std::sin(angle);
+                        orbit_forward[2] = -std::cos(angle);
+                    },
+                    [&] { orbiting.sort(system.pool, particles, 0.0f, orbit_eye, orbit_forward, &out[0]); }));
+                results.push_back(measure("depth_sort_buckets", capacity, fraction, alive, [] {},
+                    [&] { buckets.sort(system.pool, particles, 0.0f, eye, forward, &out[0]); }));
+            }
+
+            // neighbour grid and both SPH passes over a block of water, across the pool
+            fillFluid(particles, alive, system.sph.params);
+            system.grid.cell = system.sph.params.smoothing;
+            results.push_back(measure("grid_build", capacity, fraction, alive, [] {},
+                [&] { system.grid.build(system.pool, particles); }));
+            results.push_back(measure("sph", capacity, fraction, alive, [] {},
+                [&] { system.sph.apply(system.pool, particles, system.grid, 0.0f); }));
+
+            // the same water in spawn order, with neighbours scattered over the
+            // arrays, then after a Morton sort puts them back close together
+            std::vector<int> shuffle(alive);
+            for (int i = 0; i < alive; i++)
+                shuffle[i] = i;
+            for (int i = alive - 1; i > 0; i--)
+                std::swap(shuffle[i], shuffle[(int)(nextUnit() * (i + 1))]);
+            particles.permute(system.pool, &shuffle[0], alive);
+            results.push_back(measure("grid_build_shuffled", capacity, fraction, alive, [] {},
+                [&] { system.grid.build(system.pool, particles); }));
+            results.push_back(measure("sph_shuffled", capacity, fraction, alive, [] {},
+                [&] { system.sph.apply(system.pool, particles, system.grid, 0.0f); }));
+            results.push_back(measure("morton_reorder", capacity, fraction, alive,
+                [&] { particles.permute(system.pool, &shuffle[0], alive); },
+                [&] { system.morton.sort(system.pool, particles); }));
+            results.push_back(measure("grid_build_morton", capacity, fraction, alive, [] {},
+                [&] { system.grid.build(system.pool, particles); }));
+            results.push_back(measure("sph_morton", capacity, fraction, alive, [] {},
+                [&] { system.sph.apply(system.pool, particles, system.grid, 0.0f); }));
+
+            // octree build and force walk of Barnes-Hut gravity over the same block
+            std::vector<float> ax(alive), ay(alive), az(alive);
+            results.push_back(measure("barnes_hut_build", capacity, fraction, alive, [] {},
+                [&] { system.barnes_hut.build(system.pool, particles); }));
+            results.push_back(measure("barnes_hut", capacity, fraction, alive, [] {},
+                [&] { system.barnes_hut.accelerations(system.pool, system.gravitation, &ax[0], &ay[0], &az[0]); }));
+            // exact gravity, while O(N^2) stays affordable
+            if (alive <= 100000) {
+                results.push_back(measure("direct_sum", capacity, fraction, alive, [] {},
+                    [&] { system.direct_sum.accelerations(system.pool, particles, system.gravitation, &ax[0], &ay[0], &az[0]); }));
+            }
+            // and particle-mesh gravity on the default 64^3 mesh
+            results.push_back(measure("particle_mesh", capacity, fraction, alive, [] {},
+                [&] { system.particle_mesh.accelerations(system.pool, particles, system.gravitation, &ax[0], &ay[0], &az[0]); }));
+        }
+    }
+
+    if (out_path != NULL) {
+        std::ofstream file(out_path);
+        writeJson(file, results, kernel_name, pool_size);
+    } else {
+        writeJson(std::cout, results, kernel_name, pool_size);
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Thread scaling of the parallel particle update, and a check that it and
+// mesh gravity give the same results at every thread count.
+// usage: bench_threads [particles] [steps] [max_threads]
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "particle_mesh.h"
+#include "particle_update.h"
+
+static void fillStore(ParticleStore &p, int count) {
+    unsigned int state = 2463534242u;
+    for (int i = 0; i < count; i++) {
+        float values[7];
+        for (int k = 0; k < 7; k++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            values[k] = (float)(state >> 8) / (float)(1 << 24);
+        }
+        int slot = p.spawn();
+        p.pos_x[slot] = values[0] * 20.0f - 10.0f;
+        p.pos_y[slot] = values[1] * 20.0f - 10.0f;
+        p.pos_z[slot] = values[2] * 20.0f - 10.0f;
+        p.vel_x[slot] = values[3] * 10.0f - 5.0f;
+        p.vel_y[slot] = values[4] * 10.0f - 5.0f;
+        p.vel_z[slot] = values[5] * 10.0f - 5.0f;
+        // some particles die during the run, so compaction does real work
+        p.life[slot] = 0.1f + values[6] * 5.0f;
+        p.weight[slot] = 1.0f;
+    }
+}
+
+static unsigned long long checksum(const float *data, int count) {
+    unsigned long long hash = 1469598103934665603ull;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < sizeof(float) * count; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 3000000;
+    int steps = argc > 2 ? atoi(argv[2]) : 20;
+    int max_threads = argc > 3 ? atoi(argv[3]) : (int)std::thread::hardware_concurrency();
+    if (max_threads <= 0)
+        max_threads = 1;
+
+    IntegrateKernel kernel = selectIntegrateKernel();
+    StepParams params = {0.016f, 0.0f, -9.81f, 0.0f, 0.0f, 0.0f};
+    std::vector<float> out(3 * (size_t)count);
+    std::vector<int> dead(count);
+
+    std::cout << "kernel " << kernel.name << ", " << count << " particles, " << steps << " steps" << std::endl;
+    std::cout << "threads    ms/step   Mparticles/s   speedup" << std::endl;
+
+    double serial_ms = 0.0;
+    unsigned long long serial_hash = 0;
+    unsigned long long serial_mesh_hash = 0;
+    const GravityParams gravitation = {1.0f, 0.05f};
+    for (int threads = 1; threads <= max_threads; threads++) {
+        ThreadPool pool(threads);
+        ParticleStore particles(count);
+        fillStore(particles, count);
+
+        double total_ms = 0.0;
+        long long updated = 0;
+        IntegrateResult result = {0, 0};
+        for (int s = 0; s < steps; s++) {
+            int alive = particles.alive_count;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            result = integrateParallel(pool, kernel, particles, params, &out[0], &dead[0]);
+            particles.removeDead(&dead[0], result.dead);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            total_ms += elapsed.count();
+            updated += alive;
+        }
+
+        // every thread count must reproduce the serial output exactly
+        unsigned long long hash = checksum(&out[0], 3 * result.written);
+        if (threads == 1) {
+            serial_ms = total_ms;
+            serial_hash = hash;
+        } else if (hash != serial_hash) {
+            std::cout << "ERROR::BENCH_THREADS::OUTPUT_MISMATCH with " << threads << " threads" << std::endl;
+            return 1;
+        }
+
+        // and so must mesh gravity on the survivors, whose deposit sums
+        // bodies from several tasks into the same mesh points
+        ParticleMesh mesh;
+        const int alive = particles.alive_count;
+        std::vector<float> accel(3 * (size_t)alive);
+        mesh.accelerations(pool, particles, gravitation, &accel[0], &accel[alive], &accel[2 * (size_t)alive]);
+        unsigned long long mesh_hash = checksum(&accel[0], 3 * alive);
+        if (threads == 1) {
+            serial_mesh_hash = mesh_hash;
+        } else if (mesh_hash != serial_mesh_hash) {
+            std::cout << "ERROR::BENCH_THREADS::MESH_MISMATCH with " << threads << " threads" << std::endl;
+            return 1;
+        }
+
+        std::cout << std::setw(7) << threads
+                  << std::setw(11) << std::fixed << std::setprecision(3) << total_ms / steps
+                  << std::setw(15) << std::setprecision(1) << updated / (total_ms * 1000.0)
+                  << std::setw(10) << std::setprecision(2) << serial_ms / total_ms << std::endl;
+    }
+    return 0;
+}
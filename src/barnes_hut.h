@@ -0,0 +1,63 @@
+#ifndef BARNES_HUT_H
+#define BARNES_HUT_H
+
+#include <vector>
+
+#include "gravity.h"
+#include "particle_store.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
+
+struct BarnesHutNode {
+    float com[3];         // centre of mass
+    float mass;
+    float lo[3], hi[3];   // bounds of the bodies inside
+    float size;           // edge of the octree cell
+    int begin, end;       // bodies [begin, end) in tree order
+    int first_child;      // children are contiguous; none for a leaf
+    int child_count;
+};
+
+// Octree over the live particles for Barnes-Hut gravity, rebuilt from scratch
+// every step.
+// The build sorts the bodies by 30 bit Morton code of their position in the
+// bounding cube, then splits the sorted range level by level: the children of
+// every node of a level are found by binary search on the codes, in parallel,
+// and laid out contiguously after the level. Masses and centres of mass are
+// then summed bottom-up, a level at a time.
+// The force walk goes leaf by leaf: the leaf's bodies share one interaction
+// list of the nodes far enough from the whole leaf, and of the bodies of the
+// leaves that are not, which they then sum over with SSE.
+class BarnesHut
+{
+public:
+    // a cell of edge s is taken as a point mass by a leaf at least s / theta
+    // away; 0 sums every pair directly
+    float theta;
+    // most bodies in a leaf, unless they share a Morton code
+    int leaf_size;
+
+    std::vector<BarnesHutNode> nodes;   // root first, then level by level
+    std::vector<int> leaves;            // nodes without children
+    std::vector<int> order;             // slot of each body, in tree order
+    std::vector<float> sorted_x, sorted_y, sorted_z, sorted_mass;
+
+    BarnesHut();
+
+    // builds the tree over every live particle, sleepers included
+    void build(ThreadPool &pool, const ParticleStore &particles);
+    // acceleration of every body of the last build, written to ax, ay and az
+    // by slot. with active (by slot) only the bodies marked in it get theirs
+    void accelerations(ThreadPool &pool, const GravityParams &params, float *ax, float *ay, float *az,
+                       const unsigned char *active = NULL) const;
+
+private:
+    std::vector<unsigned int> codes;
+    RadixSortBuffers sort_buffers;
+    std::vector<int> level_start;
+};
+
+// accelerations with a small theta must match a direct sum on random bodies
+bool verifyBarnesHut();
+
+#endif
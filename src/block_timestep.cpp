@@ -0,0 +1,100 @@
+#include "block_timestep.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "particle_update.h"
+
+BlockTimesteps::BlockTimesteps()
+    : max_level(6), accuracy(0.025f), tick(0), evaluations(0)
+{
+}
+
+void BlockTimesteps::restart(const ParticleStore &particles, int first, int count)
+{
+    if ((int)level.size() < particles.capacity)
+        level.resize(particles.capacity, -1);
+    for (int slot = first; slot < first + count; slot++)
+        level[particles.ids[slot]] = -1;
+}
+
+int BlockTimesteps::select(ThreadPool &pool, const ParticleStore &particles)
+{
+    if ((int)level.size() < particles.capacity)
+        level.resize(particles.capacity, -1);
+    if ((int)active.size() < particles.capacity)
+        active.resize(particles.capacity);
+
+    // sleepers are never active
+    std::fill(active.begin(), active.begin() + particles.sleep_count, 0);
+    const int begin = particles.sleep_count, count = particles.alive_count - begin;
+    if (count <= 0)
+        return 0;
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    std::vector<int> chunk_active(chunks, 0);
+    pool.run(chunks, [&](int c) {
+        int end = begin + std::min(count, (c + 1) * chunk);
+        for (int i = begin + c * chunk; i < end; i++) {
+            int l = level[particles.ids[i]];
+            active[i] = l < 0 || tick % (1ll << l) == 0;
+            chunk_active[c] += active[i];
+        }
+    });
+    int total = 0;
+    for (int c = 0; c < chunks; c++)
+        total += chunk_active[c];
+    return total;
+}
+
+void BlockTimesteps::kick(ThreadPool &pool, ParticleStore &particles, const float *ax, const float *ay,
+                          const float *az, float step, float softening)
+{
+    const int begin = particles.sleep_count, count = particles.alive_count - begin;
+    // the coarsest block this step is aligned to
+    int aligned = 0;
+    while (aligned < max_level && tick % (2ll << aligned) == 0)
+        aligned++;
+
+    if (count > 0) {
+        const int chunk = updateChunkSize(pool, count);
+        const int chunks = (count + chunk - 1) / chunk;
+        std::vector<int> chunk_active(chunks, 0);
+        pool.run(chunks, [&](int c) {
+            int end = begin + std::min(count, (c + 1) * chunk);
+            for (int i = begin + c * chunk; i < end; i++) {
+                if (!active[i])
+                    continue;
+                chunk_active[c]++;
+                signed char &l = level[particles.ids[i]];
+                // close the old block, if any
+                float half = l < 0 ? 0.0f : 0.5f * step * (float)(1 << l);
+                // and open the next
+                float magnitude = std::sqrt(ax[i] * ax[i] + ay[i] * ay[i] + az[i] * az[i]);
+                float allowed = magnitude > 0.0f ? std::sqrt(2.0f * accuracy * softening / magnitude) : 1e30f;
+                int next = 0;
+                while (next < aligned && step * (float)(2 << next) <= allowed)
+                    next++;
+                half += 0.5f * step * (float)(1 << next);
+                l = (signed char)next;
+                particles.vel_x[i] += half * ax[i];
+                particles.vel_y[i] += half * ay[i];
+                particles.vel_z[i] += half * az[i];
+            }
+        });
+        for (int c = 0; c < chunks; c++)
+            evaluations += chunk_active[c];
+    }
+    tick++;
+}
+
+std::vector<int> BlockTimesteps::histogram(const ParticleStore &particles) const
+{
+    std::vector<int> counts(max_level + 1, 0);
+    for (int i = particles.sleep_count; i < particles.alive_count && !level.empty(); i++) {
+        int l = level[particles.ids[i]];
+        if (l >= 0)
+            counts[std::min(l, max_level)]++;
+    }
+    return counts;
+}
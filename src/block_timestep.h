@@ -0,0 +1,54 @@
+#ifndef BLOCK_TIMESTEP_H
+#define BLOCK_TIMESTEP_H
+
+#include <vector>
+
+#include "particle_store.h"
+#include "thread_pool.h"
+
+// Hierarchical block timesteps for mutual gravity, with a kick-drift-kick
+// leapfrog per body.
+// Every body steps every 2^level fixed steps, the fixed step being the finest
+// block. Blocks are aligned to the fixed step count, so a body is active
+// (its block ends) on the steps that are multiples of its block; only the
+// active bodies need their force. Such a body gets the closing half kick of
+// the old block and the opening half kick of the new one together, from the
+// same force; in between, every body drifts a fixed step at a time with the
+// rest of the particles, so the positions the forces are taken at are current.
+// A new block is as long as sqrt(2 * accuracy * softening / |a|) allows,
+// rounded down to a power of two of fixed steps; it may only grow to a block
+// the step count is aligned to.
+// The state is kept by particle id, so it follows the particles whatever
+// reorders their slots.
+class BlockTimesteps
+{
+public:
+    // longest block is 2^max_level fixed steps; 0 steps every body every time
+    int max_level;
+    // the eta of the step criterion
+    float accuracy;
+    // fixed steps taken so far
+    long long tick;
+    // forces taken, in total
+    long long evaluations;
+    // block of every id as a level, -1 before the first kick
+    std::vector<signed char> level;
+    // whether the body in each slot is active this step, as of select()
+    std::vector<unsigned char> active;
+
+    BlockTimesteps();
+
+    // forgets the blocks of the particles in slots [first, first + count), for
+    // particles just spawned into ids somebody used before
+    void restart(const ParticleStore &particles, int first, int count);
+    // marks the awake bodies that are active this step; returns how many there are
+    int select(ThreadPool &pool, const ParticleStore &particles);
+    // kicks the active bodies by their accelerations (by slot), picks their
+    // next block and moves on to the next step. step is the fixed step
+    void kick(ThreadPool &pool, ParticleStore &particles, const float *ax, const float *ay, const float *az,
+              float step, float softening);
+    // awake bodies on each level, finest first
+    std::vector<int> histogram(const ParticleStore &particles) const;
+};
+
+#endif
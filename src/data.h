@@ -1,19 +1,5 @@
 #ifndef SQUARE_VERTEX_H
 
-struct Square {
-    glm::vec3 pos, speed; // speed, position 
-    float r, g, b, a; // Color 
-    float size, angle, weight; 
-    int up;
-    float life; // Remaining life of the particle. if < 0 : dead and unused.
-    float cameradistance; // distance to the camera. if dead : -1.0f
-
-    bool operator<(const Square that) const {
-        return this->cameradistance > that.cameradistance;
-    }
-};
-
-
 float vertices[] = {
     // positions          // normals           // texture coords
     -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f,  0.0f,
@@ -0,0 +1,388 @@
+#include "depth_sort.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "particle_update.h"
+#include "random.h"
+
+// places a pair may move back in the insertion pass before it is pulled out
+// instead, and places the pairs so far may move on average, past the first
+// block, before the pass gives up. beyond that the radix sort is the cheaper one
+static const int INSERTION_WINDOW = 32;
+static const int INSERTION_BUDGET = 2;
+static const int INSERTION_BLOCK = 4096;
+
+DepthSort::DepthSort()
+    : mode(DEPTH_SORT_EXACT), bucket_bits(RADIX_BITS), coherence_limit(0.02f), coherent(false), pulled(0),
+      previous_count(-1), skip(0), wait(0)
+{
+}
+
+bool DepthSort::repairOrder(ThreadPool &pool, const ParticleStore &particles, int previous, int moved)
+{
+    const int count = particles.alive_count;
+    const size_t limit = (size_t)(coherence_limit * count);
+    const size_t budget = (size_t)INSERTION_BUDGET * count;
+    // last frame's order with this frame's keys. while few slots changed hands
+    // it is read by slot; after a reorder of the store each particle is found
+    // by id instead
+    const bool by_id = (size_t)moved > limit;
+    if (by_id)
+        std::fill(placed.begin(), placed.end(), 0);
+
+    // each chunk of the old order is put back in order in place by insertion,
+    // its sorted pairs compacted at the front of its part of pairs. a pair that
+    // would have to go back farther than the window is pulled out instead
+    const int chunk = updateChunkSize(pool, previous);
+    const int chunks = (previous + chunk - 1) / chunk;
+    pairs.resize(previous);
+    run_count.assign(chunks, 0);
+    pulled_by_chunk.resize(chunks);
+    std::vector<size_t> chunk_moves(chunks, 0);
+    pool.run(chunks, [&](int c) {
+        const int begin = c * chunk, end = std::min(previous, begin + chunk);
+        unsigned long long *run = &pairs[begin];
+        std::vector<unsigned long long> &pulls = pulled_by_chunk[c];
+        pulls.clear();
+        // the gather runs a block ahead of the insertion, on its own: its
+        // random reads overlap only while nothing else in the loop mispredicts,
+        // and a broken order is given up on after a block
+        size_t gathered = 0, n = 0, moves = 0;
+        for (int block = begin; block < end; block += INSERTION_BLOCK) {
+            const size_t first = gathered;
+            for (int k = block; k < std::min(end, block + INSERTION_BLOCK); k++) {
+                int slot;
+                if (by_id) {
+                    slot = particles.slot_of[previous_slot_ids[order[k]]];
+                    if (slot >= count)
+                        continue;
+                    placed[slot] = 1;
+                } else {
+                    slot = order[k];
+                    if (slot >= count || !placed[slot])
+                        continue;
+                }
+                run[gathered++] = (unsigned long long)slot_keys[slot] << 32 | (unsigned int)slot;
+            }
+            for (size_t k = first; k < gathered; k++) {
+                const unsigned long long pair = run[k];
+                if (n == 0 || run[n - 1] <= pair) {
+                    run[n++] = pair;
+                    continue;
+                }
+                size_t j = n;
+                const size_t stop = n > (size_t)INSERTION_WINDOW ? n - INSERTION_WINDOW : 0;
+                while (j > stop && run[j - 1] > pair)
+                    j--;
+                if (j > 0 && run[j - 1] > pair) {
+                    pulls.push_back(pair);
+                    // past what the whole frame may pull, it has to be sorted anyway
+                    if (pulls.size() > limit)
+                        return;
+                    continue;
+                }
+                moves += n - j;
+                if (moves > (size_t)INSERTION_BUDGET * (k + INSERTION_BLOCK)) {
+                    chunk_moves[c] = budget + 1;
+                    return;
+                }
+                for (size_t i = n; i > j; i--)
+                    run[i] = run[i - 1];
+                run[j] = pair;
+                n++;
+            }
+        }
+        run_count[c] = (int)n;
+        chunk_moves[c] = moves;
+    });
+
+    // the runs must follow on from each other: pairs at the start of a run
+    // below the end of the runs before are pulled out as well
+    size_t pulls = 0, moves = 0;
+    run_begin.resize(chunks);
+    unsigned long long high = 0;
+    for (int c = 0; c < chunks; c++) {
+        run_begin[c] = c * chunk;
+        while (run_count[c] > 0 && pairs[run_begin[c]] < high) {
+            pulled_by_chunk[c].push_back(pairs[run_begin[c]++]);
+            run_count[c]--;
+        }
+        if (run_count[c] > 0)
+            high = pairs[run_begin[c] + run_count[c] - 1];
+        pulls += pulled_by_chunk[c].size();
+        moves += chunk_moves[c];
+    }
+    if (pulls > limit || moves > budget)
+        return false;
+
+    // whoever has no place in last frame's order joins the pulled pairs
+    loose.clear();
+    for (int c = 0; c < chunks; c++)
+        loose.insert(loose.end(), pulled_by_chunk[c].begin(), pulled_by_chunk[c].end());
+    for (int i = 0; i < count; i++) {
+        if (!placed[i]) {
+            loose.push_back((unsigned long long)slot_keys[i] << 32 | (unsigned int)i);
+            if (loose.size() > limit)
+                return false;
+        }
+    }
+    std::sort(loose.begin(), loose.end());
+
+    // every run merges with the loose pairs that fall before the next run, at
+    // an offset of all the pairs below it. the first run takes the loose ones
+    // below it as well
+    std::vector<size_t> loose_begin(chunks + 1, loose.size());
+    std::vector<int> out_begin(chunks, 0);
+    size_t kept = 0;
+    bool first = true;
+    for (int c = 0; c < chunks; c++) {
+        if (run_count[c] == 0)
+            continue;
+        loose_begin[c] = first ? 0 : std::lower_bound(loose.begin(), loose.end(), pairs[run_begin[c]]) - loose.begin();
+        out_begin[c] = (int)(kept + loose_begin[c]);
+        kept += run_count[c];
+        first = false;
+    }
+    for (int c = chunks - 1; c >= 0; c--) {
+        if (run_count[c] == 0)
+            loose_begin[c] = loose_begin[c + 1];
+    }
+    order.resize(count);
+    if (kept == 0) {
+        for (int k = 0; k < count; k++)
+            order[k] = (int)(unsigned int)loose[k];
+    } else {
+        pool.run(chunks, [&](int c) {
+            if (run_count[c] == 0)
+                return;
+            const unsigned long long *run = &pairs[run_begin[c]];
+            size_t a = 0, b = loose_begin[c];
+            const size_t a_end = run_count[c], b_end = loose_begin[c + 1];
+            for (int k = out_begin[c]; a < a_end || b < b_end; k++) {
+                bool take_loose = b < b_end && (a == a_end || loose[b] < run[a]);
+                order[k] = (int)(unsigned int)(take_loose ? loose[b++] : run[a++]);
+            }
+        });
+    }
+    pulled = (int)loose.size();
+    return true;
+}
+
+int DepthSort::sort(ThreadPool &pool, const ParticleStore &particles, float lag, const float *eye,
+                    const float *forward, float *out)
+{
+    const int count = particles.alive_count;
+    const bool exact = mode == DEPTH_SORT_EXACT;
+    // only an exact sort leaves an order to repair. trying to costs a pass of
+    // random reads, so after it has not paid off it is left alone for a
+    // while, longer every time
+    const int previous = exact && coherence_limit > 0.0f && skip == 0 ? previous_count : -1;
+    skip = std::max(0, skip - 1);
+    coherent = false;
+    pulled = 0;
+    previous_count = -1;
+    if (count == 0) {
+        order.clear();
+        return 0;
+    }
+
+    // positions, depths, keys and ids by slot, in one pass through the store,
+    // so the gather in order below reads one record per particle. a slot
+    // holding another particle than last frame, or none, has no place in
+    // last frame's order
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    instances.resize(count);
+    depth.resize(count);
+    slot_keys.resize(count);
+    slot_ids.resize(count);
+    placed.resize(count);
+    std::vector<float> chunk_range(2 * (size_t)chunks);
+    std::vector<int> chunk_moved(chunks, 0);
+    pool.run(chunks, [&](int c) {
+        float nearest = 1e30f, farthest = -1e30f;
+        int moved = 0;
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            Instance &instance = instances[i];
+            instance.x = particles.pos_x[i] - particles.vel_x[i] * lag;
+            instance.y = particles.pos_y[i] - particles.vel_y[i] * lag;
+            instance.z = particles.pos_z[i] - particles.vel_z[i] * lag;
+            float d = (instance.x - eye[0]) * forward[0] + (instance.y - eye[1]) * forward[1]
+                + (instance.z - eye[2]) * forward[2];
+            depth[i] = d;
+            // farther first
+            slot_keys[i] = ~orderedKey(d);
+            slot_ids[i] = particles.ids[i];
+            placed[i] = i < previous && previous_slot_ids[i] == slot_ids[i];
+            moved += !placed[i];
+            nearest = std::min(nearest, d);
+            farthest = std::max(farthest, d);
+        }
+        chunk_range[2 * c] = nearest;
+        chunk_range[2 * c + 1] = farthest;
+        chunk_moved[c] = moved;
+    });
+    int moved = 0;
+    for (int c = 0; c < chunks; c++)
+        moved += chunk_moved[c];
+
+    if (previous >= 0) {
+        coherent = repairOrder(pool, particles, previous, moved);
+        wait = coherent ? 0 : std::min(std::max(1, 2 * wait), 64);
+        skip = wait;
+    }
+    if (!coherent) {
+        pulled = 0;
+        order.resize(count);
+        keys.resize(count);
+        if (exact) {
+            pool.run(chunks, [&](int c) {
+                for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+                    order[i] = i;
+                    keys[i] = slot_keys[i];
+                }
+            });
+            radixSortPairs(pool, keys, order, 32, sort_buffers);
+        } else {
+            float nearest = chunk_range[0], farthest = chunk_range[1];
+            for (int c = 1; c < chunks; c++) {
+                nearest = std::min(nearest, chunk_range[2 * c]);
+                farthest = std::max(farthest, chunk_range[2 * c + 1]);
+            }
+            const int bits = std::max(1, std::min(bucket_bits, 30));
+            const int top = (1 << bits) - 1;
+            const float range = farthest - nearest;
+            const float scale = range > 0.0f ? (float)(1 << bits) / (range * 1.0001f) : 0.0f;
+            pool.run(chunks, [&](int c) {
+                for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+                    order[i] = i;
+                    keys[i] = (unsigned int)std::max(0, std::min(top, (int)((farthest - depth[i]) * scale)));
+                }
+            });
+            radixSortPairs(pool, keys, order, bits, sort_buffers);
+        }
+    }
+    if (exact)
+        previous_count = count;
+    slot_ids.swap(previous_slot_ids);
+
+    pool.run(chunks, [&](int c) {
+        for (int k = c * chunk; k < std::min(count, (c + 1) * chunk); k++) {
+            const Instance &instance = instances[order[k]];
+            float *dst = out + 3 * (size_t)k;
+            dst[0] = instance.x;
+            dst[1] = instance.y;
+            dst[2] = instance.z;
+        }
+    });
+    return count;
+}
+
+// whether order holds every live slot once, out their positions, and the
+// depth along forward never rises by more than tolerance
+static bool checkSorted(const ParticleStore &p, const std::vector<int> &order, const float *out, float lag,
+                        const float *eye, const float *forward, float tolerance)
+{
+    const int count = p.alive_count;
+    if ((int)order.size() != count)
+        return false;
+    std::vector<unsigned char> seen(count, 0);
+    float last = 1e30f;
+    for (int k = 0; k < count; k++) {
+        int slot = order[k];
+        if (slot < 0 || slot >= count || seen[slot])
+            return false;
+        seen[slot] = 1;
+        if (out[3 * k] != p.pos_x[slot] - p.vel_x[slot] * lag || out[3 * k + 2] != p.pos_z[slot] - p.vel_z[slot] * lag)
+            return false;
+        float d = (out[3 * k] - eye[0]) * forward[0] + (out[3 * k + 1] - eye[1]) * forward[1]
+            + (out[3 * k + 2] - eye[2]) * forward[2];
+        if (d > last + tolerance)
+            return false;
+        last = std::min(last, d);
+    }
+    return true;
+}
+
+bool verifyDepthSort()
+{
+    const int count = 30000;
+    ParticleStore particles(count + 4000);
+    Random random(0xde97ull);
+    for (int i = 0; i < count; i++) {
+        int slot = particles.spawn();
+        particles.pos_x[slot] = 10.0f * random.symmetric();
+        particles.pos_y[slot] = 10.0f * random.symmetric();
+        particles.pos_z[slot] = 10.0f * random.symmetric();
+        particles.vel_x[slot] = random.symmetric();
+        particles.vel_y[slot] = random.symmetric();
+        particles.vel_z[slot] = random.symmetric();
+        particles.life[slot] = 1.0f;
+    }
+
+    ThreadPool pool(2);
+    DepthSort exact, scratch, buckets;
+    scratch.coherence_limit = 0.0f;
+    buckets.mode = DEPTH_SORT_BUCKETS;
+    buckets.bucket_bits = 8;
+    std::vector<float> out(3 * (size_t)particles.capacity);
+    // a slow frame moves every particle by up to a few times the depth spacing
+    // and turns the camera a little; a churning one also has fifty particles
+    // die and spawn; a render frame only interpolates differently; a reorder
+    // shuffles the store; a jump turns the camera too far for last frame's
+    // order to help. the repair must take every frame but the first, the jump
+    // and the one after it, which is sorted from scratch after the miss
+    enum Frame { START, SLOW, CHURN, RENDER, REORDER, STILL, JUMP };
+    const Frame frames[12] = {START, SLOW, SLOW, CHURN, REORDER, STILL, JUMP, SLOW, SLOW, CHURN, RENDER, SLOW};
+    float lag = 0.004f, angle = 0.0f;
+    for (int frame = 0; frame < 12; frame++) {
+        const Frame kind = frames[frame];
+        if (kind == SLOW || kind == CHURN) {
+            angle += 0.00025f;
+            for (int i = 0; i < particles.alive_count; i++) {
+                particles.pos_x[i] += 0.001f * particles.vel_x[i];
+                particles.pos_y[i] += 0.001f * particles.vel_y[i];
+                particles.pos_z[i] += 0.001f * particles.vel_z[i];
+            }
+        }
+        if (kind == RENDER)
+            lag += 0.001f;
+        if (kind == JUMP)
+            angle += 0.3f;
+        for (int i = 0; kind == CHURN && i < 50; i++)
+            particles.kill((int)(random.uniform() * particles.alive_count));
+        for (int i = 0; kind == CHURN && i < 50; i++) {
+            int slot = particles.spawn();
+            particles.pos_x[slot] = 10.0f * random.symmetric();
+            particles.pos_y[slot] = 10.0f * random.symmetric();
+            particles.pos_z[slot] = 10.0f * random.symmetric();
+            particles.vel_x[slot] = particles.vel_y[slot] = particles.vel_z[slot] = 0.0f;
+        }
+        if (kind == REORDER) {
+            std::vector<int> shuffle(particles.alive_count);
+            for (int i = 0; i < particles.alive_count; i++)
+                shuffle[i] = i;
+            for (int i = particles.alive_count - 1; i > 0; i--)
+                std::swap(shuffle[i], shuffle[(int)(random.uniform() * (i + 1)) % (i + 1)]);
+            particles.permute(shuffle.data(), particles.alive_count);
+        }
+        const float eye[3] = {30.0f * std::sin(angle), 5.0f, 30.0f * std::cos(angle)};
+        const float forward[3] = {-std::sin(angle), 0.0f, -std::cos(angle)};
+
+        exact.sort(pool, particles, lag, eye, forward, out.data());
+        if (!checkSorted(particles, exact.order, out.data(), lag, eye, forward, 0.0f))
+            return false;
+        bool repaired = kind != START && kind != JUMP && frames[frame - 1] != JUMP;
+        if (exact.coherent != repaired || (kind == STILL && exact.pulled != 0))
+            return false;
+        scratch.sort(pool, particles, lag, eye, forward, out.data());
+        if (!checkSorted(particles, scratch.order, out.data(), lag, eye, forward, 0.0f))
+            return false;
+        // within a slice of the range of 40 or so
+        buckets.sort(pool, particles, lag, eye, forward, out.data());
+        if (!checkSorted(particles, buckets.order, out.data(), lag, eye, forward, 45.0f / 256.0f))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,104 @@
+#ifndef DEPTH_SORT_H
+#define DEPTH_SORT_H
+
+#include <vector>
+
+#include "particle_store.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
+
+enum DepthSortMode {
+    DEPTH_SORT_EXACT,     // by depth as a float
+    DEPTH_SORT_BUCKETS    // by depth in one of 2^bucket_bits slices of the range
+};
+
+// key of a float that sorts as an unsigned int in the same order
+inline unsigned int orderedKey(float value)
+{
+    union { float f; unsigned int u; } bits;
+    bits.f = value;
+    return (bits.u & 0x80000000u) ? ~bits.u : bits.u | 0x80000000u;
+}
+
+// Back to front order of the live particles for blending, rebuilt every frame.
+// The depth of every particle along the view direction is turned into a 32 bit
+// key, farther first, and the (key, slot) pairs are put in order by the pool's
+// LSD radix sort, unless last frame's order is still nearly right. That order
+// is taken up again with this frame's keys: by slot while few slots changed
+// hands, by id after a reorder of the store. When the camera turns slowly and
+// the particles move by no more than about their depth spacing per frame,
+// each pair then sits within a short window of its place, and an insertion
+// pass in chunks across the pool puts it there. Pairs farther out of place,
+// like the newly spawned, are pulled out, sorted on their own and merged back
+// in. When more than coherence_limit of them would have to be pulled, or the
+// insertion moves them by more than a couple of places on average, the frame
+// is sorted from scratch, and so are the next few, more of them after every
+// miss. The spacing shrinks as the particles get denser: in a scene of a
+// million that step every frame, interpolated frames included, pairs move by
+// tens of places and the radix sort is the cheaper one.
+// In bucket mode the depth range is cut into 2^bucket_bits slices and the
+// particles are only ordered by slice, in a single pass from slot order.
+class DepthSort
+{
+public:
+    DepthSortMode mode;
+    // slices of the depth range in bucket mode, at most RADIX_BITS for one pass
+    int bucket_bits;
+    // a frame that would pull more than this fraction of its pairs out of last
+    // frame's order is sorted from scratch; 0 always sorts from scratch
+    float coherence_limit;
+    // how the last frame went: sorted by repairing last frame's order, with
+    // how many pairs pulled out
+    bool coherent;
+    int pulled;
+    // slots back to front, as of the last sort
+    std::vector<int> order;
+
+    DepthSort();
+
+    // writes the positions of the live particles less lag times their
+    // velocity (those of ParticleSystem::positions()) to out as packed xyz,
+    // farthest from eye along forward first. returns how many
+    int sort(ThreadPool &pool, const ParticleStore &particles, float lag, const float *eye, const float *forward,
+             float *out);
+
+private:
+    // interpolated position of every slot
+    struct Instance {
+        float x, y, z;
+    };
+
+    std::vector<Instance> instances;
+    // depth of every slot along forward, for bucket mode
+    std::vector<float> depth;
+    // exact key of every slot
+    std::vector<unsigned int> slot_keys;
+    // id in every slot, this frame and last
+    std::vector<int> slot_ids, previous_slot_ids;
+    // whether each slot is found in last frame's order
+    std::vector<unsigned char> placed;
+    // live slots of the last exact sort, -1 when order is not one to repair
+    int previous_count;
+    // frames to sort from scratch before trying last frame's order again,
+    // and how many that was the last time
+    int skip;
+    int wait;
+    std::vector<unsigned int> keys;
+    // pairs as key << 32 | slot: the runs of last frame's order put back in
+    // order, chunk by chunk, and those pulled out of them
+    std::vector<unsigned long long> pairs, loose;
+    std::vector<int> run_begin, run_count;
+    std::vector<std::vector<unsigned long long> > pulled_by_chunk;
+    RadixSortBuffers sort_buffers;
+
+    // repairs last frame's order of its previous live slots, given how many
+    // slots changed hands since; false when it is too far gone
+    bool repairOrder(ThreadPool &pool, const ParticleStore &particles, int previous, int moved);
+};
+
+// every mode must put the particles in order of depth, over frames of the
+// camera turning and of particles moving, dying and spawning, and the repair
+// must take the frames where they only move a little
+bool verifyDepthSort();
+
+#endif
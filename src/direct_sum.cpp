@@ -0,0 +1,235 @@
+#include "direct_sum.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "random.h"
+
+// targets per task: enough tiles of work to hide the scheduling, few enough
+// that a task's accumulators stay in L1 next to the tile
+static const int TARGETS_PER_TASK = 256;
+
+void directSumTileScalar(const float *sx, const float *sy, const float *sz, const float *sm, int begin, int end,
+                         const float *tx, const float *ty, const float *tz, int count, float eps2,
+                         float *ax, float *ay, float *az)
+{
+    for (int t = 0; t < count; t++) {
+        float sum_x = 0.0f, sum_y = 0.0f, sum_z = 0.0f;
+        for (int j = begin; j < end; j++) {
+            float dx = sx[j] - tx[t], dy = sy[j] - ty[t], dz = sz[j] - tz[t];
+            float r2 = dx * dx + dy * dy + dz * dz + eps2;
+            if (!(r2 > 0.0f))
+                continue;
+            float inv_r = 1.0f / std::sqrt(r2);
+            float s = sm[j] * inv_r * inv_r * inv_r;
+            sum_x += s * dx;
+            sum_y += s * dy;
+            sum_z += s * dz;
+        }
+        ax[t] += sum_x;
+        ay[t] += sum_y;
+        az[t] += sum_z;
+    }
+}
+
+#if defined(DIRECT_SUM_X86) && defined(__SSE2__)
+void directSumTileSSE2(const float *sx, const float *sy, const float *sz, const float *sm, int begin, int end,
+                       const float *tx, const float *ty, const float *tz, int count, float eps2,
+                       float *ax, float *ay, float *az)
+{
+    const __m128 veps2 = _mm_set1_ps(eps2), zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f), three_halves = _mm_set1_ps(1.5f);
+    // two vectors of targets, all 16 registers' worth
+    for (int t = 0; t < count; t += 8) {
+        __m128 x0 = _mm_loadu_ps(tx + t), y0 = _mm_loadu_ps(ty + t), z0 = _mm_loadu_ps(tz + t);
+        __m128 x1 = _mm_loadu_ps(tx + t + 4), y1 = _mm_loadu_ps(ty + t + 4), z1 = _mm_loadu_ps(tz + t + 4);
+        __m128 ax0 = zero, ay0 = zero, az0 = zero, ax1 = zero, ay1 = zero, az1 = zero;
+        for (int j = begin; j < end; j++) {
+            const __m128 px = _mm_set1_ps(sx[j]), py = _mm_set1_ps(sy[j]), pz = _mm_set1_ps(sz[j]);
+            const __m128 m = _mm_set1_ps(sm[j]);
+            __m128 dx0 = _mm_sub_ps(px, x0), dy0 = _mm_sub_ps(py, y0), dz0 = _mm_sub_ps(pz, z0);
+            __m128 dx1 = _mm_sub_ps(px, x1), dy1 = _mm_sub_ps(py, y1), dz1 = _mm_sub_ps(pz, z1);
+            __m128 r0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx0, dx0), _mm_mul_ps(dy0, dy0)),
+                                   _mm_add_ps(_mm_mul_ps(dz0, dz0), veps2));
+            __m128 r1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx1, dx1), _mm_mul_ps(dy1, dy1)),
+                                   _mm_add_ps(_mm_mul_ps(dz1, dz1), veps2));
+            __m128 valid0 = _mm_cmpgt_ps(r0, zero), valid1 = _mm_cmpgt_ps(r1, zero);
+            __m128 i0 = _mm_rsqrt_ps(r0), i1 = _mm_rsqrt_ps(r1);
+            i0 = _mm_mul_ps(i0, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, r0), _mm_mul_ps(i0, i0))));
+            i1 = _mm_mul_ps(i1, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, r1), _mm_mul_ps(i1, i1))));
+            __m128 s0 = _mm_and_ps(valid0, _mm_mul_ps(m, _mm_mul_ps(i0, _mm_mul_ps(i0, i0))));
+            __m128 s1 = _mm_and_ps(valid1, _mm_mul_ps(m, _mm_mul_ps(i1, _mm_mul_ps(i1, i1))));
+            ax0 = _mm_add_ps(ax0, _mm_mul_ps(s0, dx0));
+            ay0 = _mm_add_ps(ay0, _mm_mul_ps(s0, dy0));
+            az0 = _mm_add_ps(az0, _mm_mul_ps(s0, dz0));
+            ax1 = _mm_add_ps(ax1, _mm_mul_ps(s1, dx1));
+            ay1 = _mm_add_ps(ay1, _mm_mul_ps(s1, dy1));
+            az1 = _mm_add_ps(az1, _mm_mul_ps(s1, dz1));
+        }
+        _mm_storeu_ps(ax + t, _mm_add_ps(_mm_loadu_ps(ax + t), ax0));
+        _mm_storeu_ps(ay + t, _mm_add_ps(_mm_loadu_ps(ay + t), ay0));
+        _mm_storeu_ps(az + t, _mm_add_ps(_mm_loadu_ps(az + t), az0));
+        _mm_storeu_ps(ax + t + 4, _mm_add_ps(_mm_loadu_ps(ax + t + 4), ax1));
+        _mm_storeu_ps(ay + t + 4, _mm_add_ps(_mm_loadu_ps(ay + t + 4), ay1));
+        _mm_storeu_ps(az + t + 4, _mm_add_ps(_mm_loadu_ps(az + t + 4), az1));
+    }
+}
+#endif
+
+struct DirectSumEntry {
+    DirectSumKernel kernel;
+    bool supported;
+};
+
+static std::vector<DirectSumEntry> directSumTable()
+{
+    std::vector<DirectSumEntry> table;
+    DirectSumKernel scalar = {"scalar", directSumTileScalar};
+    DirectSumEntry entry = {scalar, true};
+    table.push_back(entry);
+#ifdef DIRECT_SUM_X86
+    __builtin_cpu_init();
+#ifdef __SSE2__
+    DirectSumKernel sse2 = {"sse2", directSumTileSSE2};
+    DirectSumEntry sse2_entry = {sse2, __builtin_cpu_supports("sse2") != 0};
+    table.push_back(sse2_entry);
+#endif
+    DirectSumKernel avx2 = {"avx2", directSumTileAVX2};
+    DirectSumEntry avx2_entry = {avx2, __builtin_cpu_supports("avx2") != 0 && __builtin_cpu_supports("fma") != 0};
+    table.push_back(avx2_entry);
+#endif
+    return table;
+}
+
+DirectSumKernel selectDirectSumKernel()
+{
+    std::vector<DirectSumEntry> table = directSumTable();
+    DirectSumKernel best = table[0].kernel;
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i].supported)
+            best = table[i].kernel;
+    }
+    return best;
+}
+
+DirectSum::DirectSum()
+    : kernel(selectDirectSumKernel()), tile(1024)
+{
+}
+
+void DirectSum::accelerations(ThreadPool &pool, const ParticleStore &particles, const GravityParams &params,
+                              float *ax, float *ay, float *az, const unsigned char *active)
+{
+    const int count = particles.alive_count;
+    target_slots.clear();
+    for (int i = 0; i < count; i++) {
+        if (active == NULL || active[i])
+            target_slots.push_back(i);
+    }
+    const int targets = (int)target_slots.size();
+    if (targets == 0)
+        return;
+    const int padded = (targets + DIRECT_SUM_BLOCK - 1) / DIRECT_SUM_BLOCK * DIRECT_SUM_BLOCK;
+    target_x.assign(padded, 0.0f);
+    target_y.assign(padded, 0.0f);
+    target_z.assign(padded, 0.0f);
+    for (int t = 0; t < targets; t++) {
+        target_x[t] = particles.pos_x[target_slots[t]];
+        target_y[t] = particles.pos_y[target_slots[t]];
+        target_z[t] = particles.pos_z[target_slots[t]];
+    }
+
+    const float eps2 = params.softening * params.softening;
+    const int tasks = (padded + TARGETS_PER_TASK - 1) / TARGETS_PER_TASK;
+    pool.run(tasks, [&](int task) {
+        const int first = task * TARGETS_PER_TASK, block = std::min(TARGETS_PER_TASK, padded - first);
+        float sum[3][TARGETS_PER_TASK];
+        std::memset(sum, 0, sizeof(sum));
+        for (int begin = 0; begin < count; begin += tile) {
+            kernel.run(particles.pos_x, particles.pos_y, particles.pos_z, particles.weight, begin,
+                       std::min(count, begin + tile), &target_x[first], &target_y[first], &target_z[first], block,
+                       eps2, sum[0], sum[1], sum[2]);
+        }
+        for (int t = 0; t < block && first + t < targets; t++) {
+            int slot = target_slots[first + t];
+            ax[slot] = params.constant * sum[0][t];
+            ay[slot] = params.constant * sum[1][t];
+            az[slot] = params.constant * sum[2][t];
+        }
+    });
+}
+
+bool verifyDirectSum()
+{
+    const int count = 1500;
+    ParticleStore particles(count);
+    Random random(0xd15cull);
+    int first = 0;
+    particles.spawnBlock(count, &first);
+    for (int i = 0; i < count; i++) {
+        particles.pos_x[i] = 3.0f * random.symmetric();
+        particles.pos_y[i] = 3.0f * random.symmetric();
+        particles.pos_z[i] = 3.0f * random.symmetric();
+        particles.weight[i] = 0.5f + random.uniform();
+    }
+    // two bodies in one place, which only the softening keeps apart
+    particles.pos_x[1] = particles.pos_x[0];
+    particles.pos_y[1] = particles.pos_y[0];
+    particles.pos_z[1] = particles.pos_z[0];
+
+    const GravityParams params_list[2] = {{1.0f, 0.05f}, {2.0f, 0.0f}};
+    ThreadPool pool(2);
+    std::vector<float> ax(count), ay(count), az(count);
+    std::vector<DirectSumEntry> table = directSumTable();
+    bool ok = true;
+    for (int p = 0; p < 2; p++) {
+        const GravityParams &params = params_list[p];
+        std::vector<double> exact(3 * (size_t)count, 0.0);
+        for (int i = 0; i < count; i++) {
+            for (int j = 0; j < count; j++) {
+                double d[3] = {(double)particles.pos_x[j] - particles.pos_x[i],
+                               (double)particles.pos_y[j] - particles.pos_y[i],
+                               (double)particles.pos_z[j] - particles.pos_z[i]};
+                double r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2] + (double)params.softening * params.softening;
+                if (r2 == 0.0)
+                    continue;
+                double s = params.constant * particles.weight[j] / (r2 * std::sqrt(r2));
+                for (int axis = 0; axis < 3; axis++)
+                    exact[3 * (size_t)i + axis] += s * d[axis];
+            }
+        }
+        for (size_t k = 0; k < table.size(); k++) {
+            if (!table[k].supported)
+                continue;
+            DirectSum sum;
+            sum.kernel = table[k].kernel;
+            sum.tile = 200;
+            sum.accelerations(pool, particles, params, ax.data(), ay.data(), az.data());
+            // a Newton step from the estimate leaves about 1e-7 relative error
+            double error2 = 0.0, norm2 = 0.0;
+            bool finite = true;
+            for (int i = 0; i < count; i++) {
+                const double got[3] = {ax[i], ay[i], az[i]};
+                for (int axis = 0; axis < 3; axis++) {
+                    double e = got[axis] - exact[3 * (size_t)i + axis];
+                    finite = finite && std::isfinite(got[axis]);
+                    error2 += e * e;
+                    norm2 += exact[3 * (size_t)i + axis] * exact[3 * (size_t)i + axis];
+                }
+            }
+            if (!finite || !(std::sqrt(error2 / norm2) < 1e-5)) {
+                std::cout << "direct sum kernel " << table[k].kernel.name << " is off by "
+                          << std::sqrt(error2 / norm2) << " rms" << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
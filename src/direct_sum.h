@@ -0,0 +1,74 @@
+#ifndef DIRECT_SUM_H
+#define DIRECT_SUM_H
+
+#include <vector>
+
+#include "gravity.h"
+#include "particle_store.h"
+#include "thread_pool.h"
+
+// targets a tile kernel takes at a time; target counts are padded to this
+const int DIRECT_SUM_BLOCK = 16;
+
+// Adds the pull of sources [begin, end) on count targets (a multiple of
+// DIRECT_SUM_BLOCK) to ax, ay and az. Sources and targets are packed
+// xyz(m) arrays; a source on top of a target without softening pulls nowhere.
+typedef void (*DirectSumTileFunc)(const float *sx, const float *sy, const float *sz, const float *sm, int begin,
+                                  int end, const float *tx, const float *ty, const float *tz, int count, float eps2,
+                                  float *ax, float *ay, float *az);
+
+struct DirectSumKernel {
+    const char *name;
+    DirectSumTileFunc run;
+};
+
+void directSumTileScalar(const float *sx, const float *sy, const float *sz, const float *sm, int begin, int end,
+                         const float *tx, const float *ty, const float *tz, int count, float eps2,
+                         float *ax, float *ay, float *az);
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define DIRECT_SUM_X86 1
+void directSumTileSSE2(const float *sx, const float *sy, const float *sz, const float *sm, int begin, int end,
+                       const float *tx, const float *ty, const float *tz, int count, float eps2,
+                       float *ax, float *ay, float *az);
+void directSumTileAVX2(const float *sx, const float *sy, const float *sz, const float *sm, int begin, int end,
+                       const float *tx, const float *ty, const float *tz, int count, float eps2,
+                       float *ax, float *ay, float *az);
+#endif
+
+// widest tile kernel the CPU runs
+DirectSumKernel selectDirectSumKernel();
+
+// Exact gravity between every pair of live particles, in O(N^2): the
+// reference the approximate solvers are checked against, and up to some
+// 100k bodies often quicker than they are.
+// The targets are split across the pool in blocks of a few hundred; a task
+// walks the sources one tile at a time, small enough to stay in L1, and
+// sums each tile into all of its targets before moving on. The kernels keep
+// DIRECT_SUM_BLOCK targets in registers and broadcast one source at a time,
+// with a reciprocal square root estimate and one Newton step for 1 / r.
+class DirectSum
+{
+public:
+    DirectSumKernel kernel;
+    // sources per tile
+    int tile;
+
+    DirectSum();
+
+    // acceleration of every live particle, written to ax, ay and az by slot.
+    // with active (by slot) only the marked particles get theirs, though all
+    // of them pull
+    void accelerations(ThreadPool &pool, const ParticleStore &particles, const GravityParams &params,
+                       float *ax, float *ay, float *az, const unsigned char *active = NULL);
+
+private:
+    // the sources are the store's own arrays; the targets are packed here,
+    // padded to whole blocks, with their slots
+    std::vector<float> target_x, target_y, target_z;
+    std::vector<int> target_slots;
+};
+
+// every tile kernel the CPU runs must match a sum in double precision
+bool verifyDirectSum();
+
+#endif
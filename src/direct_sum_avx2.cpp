@@ -0,0 +1,46 @@
+// compiled with -mavx2 -mfma; only called after a runtime CPU check
+#include "direct_sum.h"
+
+#ifdef DIRECT_SUM_X86
+#include <immintrin.h>
+
+void directSumTileAVX2(const float *sx, const float *sy, const float *sz, const float *sm, int begin, int end,
+                       const float *tx, const float *ty, const float *tz, int count, float eps2,
+                       float *ax, float *ay, float *az)
+{
+    const __m256 veps2 = _mm256_set1_ps(eps2), zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+    // two vectors of targets, a whole block
+    for (int t = 0; t < count; t += 16) {
+        __m256 x0 = _mm256_loadu_ps(tx + t), y0 = _mm256_loadu_ps(ty + t), z0 = _mm256_loadu_ps(tz + t);
+        __m256 x1 = _mm256_loadu_ps(tx + t + 8), y1 = _mm256_loadu_ps(ty + t + 8), z1 = _mm256_loadu_ps(tz + t + 8);
+        __m256 ax0 = zero, ay0 = zero, az0 = zero, ax1 = zero, ay1 = zero, az1 = zero;
+        for (int j = begin; j < end; j++) {
+            const __m256 px = _mm256_broadcast_ss(sx + j), py = _mm256_broadcast_ss(sy + j);
+            const __m256 pz = _mm256_broadcast_ss(sz + j), m = _mm256_broadcast_ss(sm + j);
+            __m256 dx0 = _mm256_sub_ps(px, x0), dy0 = _mm256_sub_ps(py, y0), dz0 = _mm256_sub_ps(pz, z0);
+            __m256 dx1 = _mm256_sub_ps(px, x1), dy1 = _mm256_sub_ps(py, y1), dz1 = _mm256_sub_ps(pz, z1);
+            __m256 r0 = _mm256_fmadd_ps(dx0, dx0, _mm256_fmadd_ps(dy0, dy0, _mm256_fmadd_ps(dz0, dz0, veps2)));
+            __m256 r1 = _mm256_fmadd_ps(dx1, dx1, _mm256_fmadd_ps(dy1, dy1, _mm256_fmadd_ps(dz1, dz1, veps2)));
+            __m256 valid0 = _mm256_cmp_ps(r0, zero, _CMP_GT_OQ), valid1 = _mm256_cmp_ps(r1, zero, _CMP_GT_OQ);
+            __m256 i0 = _mm256_rsqrt_ps(r0), i1 = _mm256_rsqrt_ps(r1);
+            i0 = _mm256_mul_ps(i0, _mm256_fnmadd_ps(_mm256_mul_ps(half, r0), _mm256_mul_ps(i0, i0), three_halves));
+            i1 = _mm256_mul_ps(i1, _mm256_fnmadd_ps(_mm256_mul_ps(half, r1), _mm256_mul_ps(i1, i1), three_halves));
+            __m256 s0 = _mm256_and_ps(valid0, _mm256_mul_ps(m, _mm256_mul_ps(i0, _mm256_mul_ps(i0, i0))));
+            __m256 s1 = _mm256_and_ps(valid1, _mm256_mul_ps(m, _mm256_mul_ps(i1, _mm256_mul_ps(i1, i1))));
+            ax0 = _mm256_fmadd_ps(s0, dx0, ax0);
+            ay0 = _mm256_fmadd_ps(s0, dy0, ay0);
+            az0 = _mm256_fmadd_ps(s0, dz0, az0);
+            ax1 = _mm256_fmadd_ps(s1, dx1, ax1);
+            ay1 = _mm256_fmadd_ps(s1, dy1, ay1);
+            az1 = _mm256_fmadd_ps(s1, dz1, az1);
+        }
+        _mm256_storeu_ps(ax + t, _mm256_add_ps(_mm256_loadu_ps(ax + t), ax0));
+        _mm256_storeu_ps(ay + t, _mm256_add_ps(_mm256_loadu_ps(ay + t), ay0));
+        _mm256_storeu_ps(az + t, _mm256_add_ps(_mm256_loadu_ps(az + t), az0));
+        _mm256_storeu_ps(ax + t + 8, _mm256_add_ps(_mm256_loadu_ps(ax + t + 8), ax1));
+        _mm256_storeu_ps(ay + t + 8, _mm256_add_ps(_mm256_loadu_ps(ay + t + 8), ay1));
+        _mm256_storeu_ps(az + t + 8, _mm256_add_ps(_mm256_loadu_ps(az + t + 8), az1));
+    }
+}
+#endif
@@ -0,0 +1,190 @@
+#include "distance_field.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// closest point to p on triangle abc (Ericson, Real-Time Collision Detection 5.1.5)
+static glm::vec3 closestOnTriangle(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+{
+    glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+        return a;
+
+    glm::vec3 bp = p - b;
+    float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+        return b;
+
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+        return a + ab * (d1 / (d1 - d3));
+
+    glm::vec3 cp = p - c;
+    float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+        return c;
+
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+        return a + ac * (d2 / (d2 - d6));
+
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+DistanceField::DistanceField()
+    : origin(0.0f), cell(1.0f), band(0.0f), nx(0), ny(0), nz(0), bx(0), by(0), bz(0)
+{
+}
+
+bool DistanceField::bake(const std::vector<glm::vec3> &vertices, const std::vector<unsigned int> &indices,
+                         float cell_size, float band_width, ThreadPool &pool)
+{
+    const int triangles = (int)indices.size() / 3;
+    if (triangles == 0 || cell_size <= 0.0f) {
+        std::cout << "ERROR::DISTANCE_FIELD::NOTHING_TO_BAKE" << std::endl;
+        return false;
+    }
+
+    glm::vec3 low(vertices[indices[0]]), high(low);
+    for (size_t i = 0; i < indices.size(); i++) {
+        low = glm::min(low, vertices[indices[i]]);
+        high = glm::max(high, vertices[indices[i]]);
+    }
+
+    cell = cell_size;
+    band = std::max(band_width, cell_size);
+    origin = low - glm::vec3(band + cell);
+    glm::vec3 size = high - low + glm::vec3(2.0f * (band + cell));
+    nx = (int)std::ceil(size.x / cell) + 1;
+    ny = (int)std::ceil(size.y / cell) + 1;
+    nz = (int)std::ceil(size.z / cell) + 1;
+    bx = (nx + BRICK - 1) / BRICK;
+    by = (ny + BRICK - 1) / BRICK;
+    bz = (nz + BRICK - 1) / BRICK;
+
+    // node range of every triangle's bounds grown by the band, as
+    // low x, y, z then high x, y, z, and the brick layers each triangle touches
+    std::vector<int> range(6 * (size_t)triangles);
+    std::vector<std::vector<int> > layers(bz);
+    bricks.assign((size_t)bx * by * bz, -1);
+    const int last[3] = {nx - 1, ny - 1, nz - 1};
+    int brick_count = 0;
+    for (int t = 0; t < triangles; t++) {
+        const glm::vec3 &a = vertices[indices[3 * t]];
+        const glm::vec3 &b = vertices[indices[3 * t + 1]];
+        const glm::vec3 &c = vertices[indices[3 * t + 2]];
+        glm::vec3 lo = (glm::min(a, glm::min(b, c)) - glm::vec3(band) - origin) / cell;
+        glm::vec3 hi = (glm::max(a, glm::max(b, c)) + glm::vec3(band) - origin) / cell;
+        int *r = &range[6 * (size_t)t];
+        for (int axis = 0; axis < 3; axis++) {
+            r[axis] = std::max((int)std::floor(lo[axis]), 0);
+            r[3 + axis] = std::min((int)std::ceil(hi[axis]), last[axis]);
+        }
+
+        for (int k = r[2] / BRICK; k <= r[5] / BRICK; k++) {
+            layers[k].push_back(t);
+            for (int j = r[1] / BRICK; j <= r[4] / BRICK; j++) {
+                for (int i = r[0] / BRICK; i <= r[3] / BRICK; i++) {
+                    int &brick = bricks[((size_t)k * by + j) * bx + i];
+                    if (brick < 0)
+                        brick = BRICK * BRICK * BRICK * brick_count++;
+                }
+            }
+        }
+    }
+    values.assign((size_t)brick_count * BRICK * BRICK * BRICK, band);
+
+    // how squarely the closest triangle faces each node; among triangles at
+    // the same distance (at shared edges and corners) the most direct one
+    // decides the sign
+    std::vector<float> facing(values.size(), 0.0f);
+    const float tie = 1e-4f * cell;
+
+    pool.run(bz, [&](int layer) {
+        int z_begin = layer * BRICK, z_end = std::min(nz, z_begin + BRICK);
+        for (size_t n = 0; n < layers[layer].size(); n++) {
+            int t = layers[layer][n];
+            const glm::vec3 &a = vertices[indices[3 * t]];
+            const glm::vec3 &b = vertices[indices[3 * t + 1]];
+            const glm::vec3 &c = vertices[indices[3 * t + 2]];
+            glm::vec3 face = glm::cross(b - a, c - a);
+            float area = glm::length(face);
+            if (area <= 0.0f)
+                continue;
+            face /= area;
+
+            const int *r = &range[6 * (size_t)t];
+            int k_begin = std::max(r[2], z_begin), k_end = std::min(r[5] + 1, z_end);
+            for (int k = k_begin; k < k_end; k++) {
+                for (int j = r[1]; j <= r[4]; j++) {
+                    for (int i = r[0]; i <= r[3]; i++) {
+                        glm::vec3 p = origin + glm::vec3((float)i, (float)j, (float)k) * cell;
+                        glm::vec3 offset = p - closestOnTriangle(p, a, b, c);
+                        float distance = glm::length(offset);
+                        if (distance > band)
+                            continue;
+
+                        int brick = bricks[((size_t)(k / BRICK) * by + j / BRICK) * bx + i / BRICK];
+                        size_t slot = brick + (i % BRICK) + BRICK * ((j % BRICK) + BRICK * (k % BRICK));
+                        float current = std::fabs(values[slot]);
+                        float side = glm::dot(offset, face);
+                        float direct = distance > 0.0f ? std::fabs(side) / distance : 1.0f;
+                        if (distance < current - tie || (distance <= current + tie && direct > facing[slot])) {
+                            values[slot] = side < 0.0f ? -distance : distance;
+                            facing[slot] = direct;
+                        }
+                    }
+                }
+            }
+        }
+    });
+    return true;
+}
+
+bool DistanceField::empty() const
+{
+    return values.empty();
+}
+
+float DistanceField::node(int i, int j, int k) const
+{
+    int brick = bricks[((size_t)(k / BRICK) * by + j / BRICK) * bx + i / BRICK];
+    if (brick < 0)
+        return band;
+    return values[brick + (i % BRICK) + BRICK * ((j % BRICK) + BRICK * (k % BRICK))];
+}
+
+float DistanceField::sample(const glm::vec3 &p) const
+{
+    glm::vec3 g = (p - origin) / cell;
+    if (!(g.x >= 0.0f && g.y >= 0.0f && g.z >= 0.0f &&
+          g.x < nx - 1 && g.y < ny - 1 && g.z < nz - 1))
+        return band;
+
+    int i = (int)g.x, j = (int)g.y, k = (int)g.z;
+    float fx = g.x - i, fy = g.y - j, fz = g.z - k;
+    float c00 = node(i, j, k) + (node(i + 1, j, k) - node(i, j, k)) * fx;
+    float c10 = node(i, j + 1, k) + (node(i + 1, j + 1, k) - node(i, j + 1, k)) * fx;
+    float c01 = node(i, j, k + 1) + (node(i + 1, j, k + 1) - node(i, j, k + 1)) * fx;
+    float c11 = node(i, j + 1, k + 1) + (node(i + 1, j + 1, k + 1) - node(i, j + 1, k + 1)) * fx;
+    float c0 = c00 + (c10 - c00) * fy;
+    float c1 = c01 + (c11 - c01) * fy;
+    return c0 + (c1 - c0) * fz;
+}
+
+glm::vec3 DistanceField::normal(const glm::vec3 &p) const
+{
+    float h = 0.5f * cell;
+    glm::vec3 gradient(sample(p + glm::vec3(h, 0.0f, 0.0f)) - sample(p - glm::vec3(h, 0.0f, 0.0f)),
+                       sample(p + glm::vec3(0.0f, h, 0.0f)) - sample(p - glm::vec3(0.0f, h, 0.0f)),
+                       sample(p + glm::vec3(0.0f, 0.0f, h)) - sample(p - glm::vec3(0.0f, 0.0f, h)));
+    float length = glm::length(gradient);
+    return length > 0.0f ? gradient / length : glm::vec3(0.0f, 1.0f, 0.0f);
+}
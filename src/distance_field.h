@@ -0,0 +1,48 @@
+#ifndef DISTANCE_FIELD_H
+#define DISTANCE_FIELD_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+#include "thread_pool.h"
+
+// Signed distance to a triangle mesh, sampled on a regular grid of nodes.
+// Only a narrow band around the surface is stored: the grid is cut into bricks
+// of BRICK^3 nodes and a brick gets values only if some triangle passes within
+// band of it. Every other node reads as +band, i.e. far outside.
+// The sign comes from the face normal of the closest triangle, so the mesh
+// should be consistently wound but need not be closed.
+class DistanceField
+{
+public:
+    static const int BRICK = 8;
+
+    glm::vec3 origin;      // position of node (0, 0, 0)
+    float cell;            // spacing between nodes
+    float band;            // distances are exact within this of the surface
+    int nx, ny, nz;        // nodes per axis
+    int bx, by, bz;        // bricks per axis
+
+    // first value of each brick, or -1 for bricks outside the band
+    std::vector<int> bricks;
+    std::vector<float> values;
+
+    DistanceField();
+
+    // builds the field of the triangles indices[3t .. 3t+2] over vertices.
+    // the bricks are baked in parallel, one layer of bricks per task
+    bool bake(const std::vector<glm::vec3> &vertices, const std::vector<unsigned int> &indices,
+              float cell, float band, ThreadPool &pool);
+
+    bool empty() const;
+    // trilinear interpolation of the nodes around p; +band outside the grid
+    float sample(const glm::vec3 &p) const;
+    // unit direction of steepest increase at p, from central differences
+    glm::vec3 normal(const glm::vec3 &p) const;
+
+private:
+    float node(int i, int j, int k) const;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include "emitter.h"
+
+#include <algorithm>
+#include <cmath>
+
+// random planes drawn per particle, see initialize()
+static const int PLANES = 10;
+static const float PI = 3.14159265358979f;
+
+// two unit vectors perpendicular to axis and to each other
+static void basis(const glm::vec3 &axis, glm::vec3 &t, glm::vec3 &b)
+{
+    glm::vec3 helper = std::fabs(axis.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    t = glm::normalize(glm::cross(axis, helper));
+    b = glm::cross(axis, t);
+}
+
+Emitter::Emitter()
+    : shape(EMITTER_POINT), position(0.0f), direction(0.0f, 1.0f, 0.0f), extent(1.0f),
+      radius(1.0f), cone_angle(0.5f), velocity(0.0f), velocity_spread(0.0f),
+      speed_min(0.0f), speed_max(0.0f), life_min(1.0f), life_max(1.0f), mass(1.0f),
+      rate(0.0f), max_per_step(1 << 30), enabled(true), pending_burst(0), carry(0.0f)
+{
+}
+
+void Emitter::burst(int count)
+{
+    if (count > 0)
+        pending_burst += count;
+}
+
+int Emitter::due(float dt)
+{
+    float exact = dt * rate + carry;
+    int count = (int)exact;
+    carry = exact - (float)count;
+    count = std::min(count, max_per_step) + pending_burst;
+    pending_burst = 0;
+    return count;
+}
+
+void Emitter::initialize(ParticleStore &p, int first, int count, RandomBatch &rng,
+                         std::vector<float> &scratch) const
+{
+    if (count <= 0)
+        return;
+
+    // planes 0-2 place the particle, 3-4 pick the outward heading, 5 the speed,
+    // 6-8 the velocity offset and 9 the life, all uniform in [-1, 1)
+    scratch.resize(PLANES * (size_t)count);
+    rng.fillSymmetric(scratch.data(), PLANES * count);
+    const float *s[PLANES];
+    for (int k = 0; k < PLANES; k++)
+        s[k] = scratch.data() + (size_t)k * count;
+
+    float *px = p.pos_x + first, *py = p.pos_y + first, *pz = p.pos_z + first;
+    float *vx = p.vel_x + first, *vy = p.vel_y + first, *vz = p.vel_z + first;
+    float *life = p.life + first;
+
+    glm::vec3 axis = glm::length(direction) > 0.0f ? glm::normalize(direction) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 t, b;
+    basis(axis, t, b);
+
+    // start from the outward heading in the velocity arrays, scaled by speed below
+    switch (shape) {
+    case EMITTER_POINT:
+    case EMITTER_SPHERE:
+        for (int i = 0; i < count; i++) {
+            float z = s[3][i];
+            float ring = std::sqrt(std::max(0.0f, 1.0f - z * z));
+            float phi = PI * s[4][i];
+            vx[i] = ring * std::cos(phi);
+            vy[i] = ring * std::sin(phi);
+            vz[i] = z;
+        }
+        break;
+    case EMITTER_BOX:
+        for (int i = 0; i < count; i++) {
+            vx[i] = 0.0f;
+            vy[i] = 0.0f;
+            vz[i] = 0.0f;
+        }
+        break;
+    case EMITTER_DISK:
+        for (int i = 0; i < count; i++) {
+            vx[i] = axis.x;
+            vy[i] = axis.y;
+            vz[i] = axis.z;
+        }
+        break;
+    case EMITTER_CONE: {
+        float cos_angle = std::cos(cone_angle);
+        for (int i = 0; i < count; i++) {
+            float u = 0.5f * (s[3][i] + 1.0f);
+            float c = 1.0f - u * (1.0f - cos_angle);
+            float sn = std::sqrt(std::max(0.0f, 1.0f - c * c));
+            float phi = PI * s[4][i];
+            float ct = sn * std::cos(phi), cb = sn * std::sin(phi);
+            vx[i] = axis.x * c + t.x * ct + b.x * cb;
+            vy[i] = axis.y * c + t.y * ct + b.y * cb;
+            vz[i] = axis.z * c + t.z * ct + b.z * cb;
+        }
+        break;
+    }
+    }
+
+    switch (shape) {
+    case EMITTER_POINT:
+    case EMITTER_CONE:
+        std::fill(px, px + count, position.x);
+        std::fill(py, py + count, position.y);
+        std::fill(pz, pz + count, position.z);
+        break;
+    case EMITTER_BOX:
+        for (int i = 0; i < count; i++) {
+            px[i] = position.x + s[0][i] * extent.x;
+            py[i] = position.y + s[1][i] * extent.y;
+            pz[i] = position.z + s[2][i] * extent.z;
+        }
+        break;
+    case EMITTER_SPHERE:
+        // along the outward heading, cube root for uniform density in the ball
+        for (int i = 0; i < count; i++) {
+            float r = radius * std::cbrt(0.5f * (s[0][i] + 1.0f));
+            px[i] = position.x + vx[i] * r;
+            py[i] = position.y + vy[i] * r;
+            pz[i] = position.z + vz[i] * r;
+        }
+        break;
+    case EMITTER_DISK:
+        for (int i = 0; i < count; i++) {
+            float r = radius * std::sqrt(0.5f * (s[0][i] + 1.0f));
+            float phi = PI * s[1][i];
+            float along_t = r * std::cos(phi), along_b = r * std::sin(phi);
+            px[i] = position.x + t.x * along_t + b.x * along_b;
+            py[i] = position.y + t.y * along_t + b.y * along_b;
+            pz[i] = position.z + t.z * along_t + b.z * along_b;
+        }
+        break;
+    }
+
+    const float speed_mid = 0.5f * (speed_min + speed_max), speed_half = 0.5f * (speed_max - speed_min);
+    const float life_mid = 0.5f * (life_min + life_max), life_half = 0.5f * (life_max - life_min);
+    for (int i = 0; i < count; i++) {
+        float speed = speed_mid + speed_half * s[5][i];
+        vx[i] = velocity.x + vx[i] * speed + s[6][i] * velocity_spread;
+        vy[i] = velocity.y + vy[i] * speed + s[7][i] * velocity_spread;
+        vz[i] = velocity.z + vz[i] * speed + s[8][i] * velocity_spread;
+        life[i] = life_mid + life_half * s[9][i];
+    }
+    std::fill(p.weight + first, p.weight + first + count, mass);
+}
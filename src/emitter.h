@@ -0,0 +1,64 @@
+#ifndef EMITTER_H
+#define EMITTER_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+#include "particle_store.h"
+#include "random.h"
+
+enum EmitterShape {
+    EMITTER_POINT,  // everything starts at position
+    EMITTER_BOX,    // uniform in position +- extent
+    EMITTER_SPHERE, // uniform in the ball of radius around position
+    EMITTER_DISK,   // uniform on the disk of radius around position, facing direction
+    EMITTER_CONE    // starts at position, heading somewhere within cone_angle of direction
+};
+
+// A particle source. Every particle gets
+//   velocity + speed * outward + a uniform offset in +-velocity_spread per axis
+// where outward is away from the centre for points and spheres, along direction
+// for disks, a random heading inside the cone for cones, and zero for boxes.
+// Speed and life are drawn uniformly from their ranges.
+class Emitter
+{
+public:
+    EmitterShape shape;
+    glm::vec3 position;
+    glm::vec3 direction;   // axis of disks and cones
+    glm::vec3 extent;      // half size of boxes
+    float radius;          // spheres and disks
+    float cone_angle;      // half angle of cones, radians
+
+    glm::vec3 velocity;
+    float velocity_spread;
+    float speed_min, speed_max;
+    float life_min, life_max;
+    float mass;            // weight of every particle, for mutual gravity
+
+    float rate;            // particles per second
+    int max_per_step;      // cap on the continuous rate, bursts are not capped
+    bool enabled;
+
+    // a point emitting nothing until rate or a burst is set
+    Emitter();
+
+    // queues count particles on top of the rate for the next step
+    void burst(int count);
+    // particles to spawn for a step of dt seconds; takes the queued bursts.
+    // the fraction of a particle left over carries into the next step, so the
+    // long run rate is exact whatever the step length
+    int due(float dt);
+
+    // writes position, velocity, life and weight of slots [first, first + count) in one
+    // pass per attribute; scratch is reused between calls to avoid allocations
+    void initialize(ParticleStore &p, int first, int count, RandomBatch &rng,
+                    std::vector<float> &scratch) const;
+
+private:
+    int pending_burst;
+    float carry;
+};
+
+#endif
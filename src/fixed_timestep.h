@@ -0,0 +1,58 @@
+#ifndef FIXED_TIMESTEP_H
+#define FIXED_TIMESTEP_H
+
+// Accumulates measured frame time and hands it out as whole simulation steps of
+// a fixed size, so the simulation does not depend on the frame rate.
+// The state left in the accumulator says how far the renderer is past the last
+// simulated step; rendering lerp(previous, current, alpha()) hides the stepping.
+class FixedTimestep
+{
+public:
+    // seconds per simulation step
+    float step;
+    // most steps run for one frame. after a long stall the rest of the backlog
+    // is dropped rather than caught up, so a slow frame cannot cause slower ones
+    int max_steps;
+    // simulated time not yet consumed by a step
+    float accumulator;
+    // total backlog thrown away because of max_steps
+    double dropped_time;
+
+    FixedTimestep(float step = 1.0f / 60.0f, int max_steps = 8)
+        : step(step), max_steps(max_steps), accumulator(0.0f), dropped_time(0.0)
+    {
+    }
+
+    // adds one frame of real time and returns how many steps to run now
+    int advance(float frame_time)
+    {
+        if (frame_time > 0.0f)
+            accumulator += frame_time;
+
+        int steps = (int)(accumulator / step);
+        if (steps > max_steps) {
+            dropped_time += accumulator - max_steps * step;
+            accumulator = max_steps * step;
+            steps = max_steps;
+        }
+        accumulator -= steps * step;
+        if (accumulator < 0.0f)
+            accumulator = 0.0f;
+        return steps;
+    }
+
+    // how far between the previous and the current state the frame is, in [0, 1)
+    float alpha() const
+    {
+        float a = accumulator / step;
+        return a < 1.0f ? a : 1.0f;
+    }
+
+    // time the rendered state trails the current one, as used by StepParams::output_lag
+    float outputLag() const
+    {
+        return (1.0f - alpha()) * step;
+    }
+};
+
+#endif
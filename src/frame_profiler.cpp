@@ -0,0 +1,143 @@
+#include "frame_profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+FrameProfiler::FrameProfiler(int history) : history(history > 0 ? history : 1), frames(0)
+{
+}
+
+int FrameProfiler::phase(const std::string &name)
+{
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names[i] == name)
+            return (int)i;
+    }
+    names.push_back(name);
+    late.push_back(false);
+    samples.push_back(std::vector<float>(history, 0.0f));
+    current.push_back(0.0);
+    return (int)names.size() - 1;
+}
+
+int FrameProfiler::latePhase(const std::string &name)
+{
+    int index = phase(name);
+    late[index] = true;
+    return index;
+}
+
+int FrameProfiler::phaseCount() const
+{
+    return (int)names.size();
+}
+
+const std::string &FrameProfiler::phaseName(int phase) const
+{
+    return names[phase];
+}
+
+void FrameProfiler::beginFrame()
+{
+    std::fill(current.begin(), current.end(), 0.0);
+}
+
+void FrameProfiler::endFrame()
+{
+    int slot = frames % history;
+    for (size_t i = 0; i < names.size(); i++)
+        samples[i][slot] = late[i] ? NAN : (float)current[i];
+    frames++;
+}
+
+int FrameProfiler::frameIndex() const
+{
+    return frames;
+}
+
+void FrameProfiler::record(int phase, double ms)
+{
+    if (phase >= 0 && phase < (int)current.size())
+        current[phase] += ms;
+}
+
+void FrameProfiler::recordLate(int phase, int frame, double ms)
+{
+    // the frame must be committed and not yet overwritten
+    if (phase >= 0 && phase < (int)names.size() && late[phase] && frame < frames && frame >= frames - history)
+        samples[phase][frame % history] = (float)ms;
+}
+
+FrameProfiler::Stats FrameProfiler::stats(int phase) const
+{
+    Stats result = {0, 0.0, 0.0, 0.0, 0.0};
+    int count = std::min(frames, history);
+    if (count == 0 || phase < 0 || phase >= (int)names.size())
+        return result;
+
+    std::vector<float> sorted;
+    sorted.reserve(count);
+    for (int i = 0; i < count; i++) {
+        if (!std::isnan(samples[phase][i]))
+            sorted.push_back(samples[phase][i]);
+    }
+    count = (int)sorted.size();
+    if (count == 0)
+        return result;
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for (int i = 0; i < count; i++)
+        sum += sorted[i];
+
+    result.samples = count;
+    result.min_ms = sorted[0];
+    result.max_ms = sorted[count - 1];
+    result.mean_ms = sum / count;
+    result.p99_ms = sorted[(int)(0.99 * (count - 1))];
+    return result;
+}
+
+std::string FrameProfiler::summary() const
+{
+    std::string text;
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-16s %8s %9s %9s %9s %9s\n", "phase", "frames", "min ms", "mean ms", "p99 ms", "max ms");
+    text += line;
+    for (int i = 0; i < (int)names.size(); i++) {
+        Stats s = stats(i);
+        std::snprintf(line, sizeof(line), "%-16s %8d %9.3f %9.3f %9.3f %9.3f\n",
+                      names[i].c_str(), s.samples, s.min_ms, s.mean_ms, s.p99_ms, s.max_ms);
+        text += line;
+    }
+    return text;
+}
+
+bool FrameProfiler::writeCsv(const std::string &path) const
+{
+    std::ofstream file(path.c_str());
+    if (!file) {
+        std::cout << "ERROR::FRAME_PROFILER::FILE_NOT_WRITABLE " << path << std::endl;
+        return false;
+    }
+
+    file << "frame";
+    for (size_t i = 0; i < names.size(); i++)
+        file << "," << names[i];
+    file << "\n";
+
+    int count = std::min(frames, history);
+    for (int f = frames - count; f < frames; f++) {
+        file << f;
+        for (size_t i = 0; i < names.size(); i++) {
+            // a late phase's missing samples stay empty
+            file << ",";
+            if (!std::isnan(samples[i][f % history]))
+                file << samples[i][f % history];
+        }
+        file << "\n";
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef FRAME_PROFILER_H
+#define FRAME_PROFILER_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Per-phase frame timing.
+// Phases are registered by name; time recorded for a phase during a frame is
+// summed (a phase may run several times, e.g. once per simulation step) and
+// committed to that phase's ring of recent frames by endFrame().
+// A late phase is measured after its frame has been committed, e.g. GPU time
+// read back a few frames on: recordLate() fills in the frame it belongs to,
+// and frames that never get a sample are left out of its statistics.
+class FrameProfiler
+{
+public:
+    struct Stats {
+        int samples;
+        double min_ms, mean_ms, p99_ms, max_ms;
+    };
+
+    // keeps the last `history` frames
+    explicit FrameProfiler(int history = 1000);
+
+    // returns the index of the phase with this name, adding it if needed
+    int phase(const std::string &name);
+    // the same for a late phase
+    int latePhase(const std::string &name);
+    int phaseCount() const;
+    const std::string &phaseName(int phase) const;
+
+    void beginFrame();
+    void endFrame();
+    // index of the frame being recorded, for recordLate()
+    int frameIndex() const;
+    // adds time to a phase of the current frame
+    void record(int phase, double ms);
+    // sets a late phase's time for a committed frame still in the ring
+    void recordLate(int phase, int frame, double ms);
+
+    // statistics over the frames in the ring
+    Stats stats(int phase) const;
+    // one line per phase with min/mean/p99/max
+    std::string summary() const;
+
+    // one row per frame in the ring, one column per phase, oldest first
+    bool writeCsv(const std::string &path) const;
+
+private:
+    int history;
+    int frames;       // frames committed so far, the ring holds the last min(frames, history)
+    std::vector<std::string> names;
+    std::vector<bool> late;
+    // NaN where a late phase has no sample
+    std::vector<std::vector<float> > samples;
+    std::vector<double> current;
+};
+
+// Times its own lifetime into a phase. A NULL profiler makes it a no-op, so
+// code can be instrumented unconditionally.
+class ScopedTimer
+{
+public:
+    ScopedTimer(FrameProfiler *profiler, int phase)
+        : profiler(profiler), phase_index(phase)
+    {
+        if (profiler != NULL)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~ScopedTimer()
+    {
+        if (profiler != NULL) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            profiler->record(phase_index, elapsed.count());
+        }
+    }
+
+private:
+    FrameProfiler *profiler;
+    int phase_index;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
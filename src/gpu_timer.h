@@ -0,0 +1,148 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <glad/glad.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "frame_profiler.h"
+
+// GPU pass timing with GL_TIME_ELAPSED queries.
+// Every pass owns one query per frame in a ring of `depth` frames. A frame's
+// results are only read once GL reports them available, so the CPU never waits
+// on the GPU; the GPU phases of the profiler therefore trail the CPU phases by
+// the few frames the driver runs behind. Each result is filled into the
+// profiler frame it was measured on, as a late phase, so the GPU phases sit
+// beside the CPU phases of the same frame. If the ring wraps before a frame's
+// results arrive, that frame is dropped rather than waited for, and has no
+// GPU sample.
+// TIME_ELAPSED queries cannot nest, so passes must not overlap.
+class GpuTimer
+{
+public:
+    GpuTimer(FrameProfiler *profiler, int depth = 4)
+        : profiler(profiler), depth(depth > 1 ? depth : 2), frame(0), oldest(0), dropped_frames(0), active_pass(-1),
+          profiled_frame(this->depth, -1)
+    {
+    }
+
+    // deletes the queries; call while the GL context is still current
+    void release()
+    {
+        for (size_t i = 0; i < queries.size(); i++)
+            glDeleteQueries(depth, &queries[i][0]);
+        queries.clear();
+        issued.clear();
+        phases.clear();
+    }
+
+    // registers a pass, timed into the profiler phase "gpu_<name>"
+    int pass(const std::string &name)
+    {
+        std::vector<GLuint> ring(depth, 0);
+        glGenQueries(depth, &ring[0]);
+        queries.push_back(ring);
+        issued.push_back(std::vector<bool>(depth, false));
+        phases.push_back(profiler->latePhase("gpu_" + name));
+        return (int)queries.size() - 1;
+    }
+
+    // collects whatever finished frames are ready, then opens a new frame;
+    // call after FrameProfiler::beginFrame()
+    void beginFrame()
+    {
+        collect();
+        if (frame - oldest >= depth) {
+            // the GPU is a full ring behind: give up on the oldest frame
+            discard(oldest % depth);
+            oldest++;
+            dropped_frames++;
+        }
+        profiled_frame[frame % depth] = profiler->frameIndex();
+    }
+
+    void endFrame()
+    {
+        frame++;
+    }
+
+    void begin(int pass)
+    {
+        if (active_pass >= 0) {
+            std::cout << "ERROR::GPU_TIMER::PASSES_OVERLAP " << pass << std::endl;
+            return;
+        }
+        int slot = frame % depth;
+        glBeginQuery(GL_TIME_ELAPSED, queries[pass][slot]);
+        issued[pass][slot] = true;
+        active_pass = pass;
+    }
+
+    void end(int pass)
+    {
+        if (active_pass != pass)
+            return;
+        glEndQuery(GL_TIME_ELAPSED);
+        active_pass = -1;
+    }
+
+    int droppedFrames() const
+    {
+        return dropped_frames;
+    }
+
+private:
+    FrameProfiler *profiler;
+    int depth;
+    int frame;           // frame being recorded
+    int oldest;          // oldest frame whose results are still outstanding
+    int dropped_frames;
+    int active_pass;
+    std::vector<std::vector<GLuint> > queries;
+    std::vector<std::vector<bool> > issued;
+    std::vector<int> phases;
+    // profiler frame each slot of the ring was recorded in
+    std::vector<int> profiled_frame;
+
+    // frames complete in order, so stop at the first one that is not ready
+    void collect()
+    {
+        while (oldest < frame) {
+            int slot = oldest % depth;
+            if (!ready(slot))
+                return;
+            for (size_t p = 0; p < queries.size(); p++) {
+                if (!issued[p][slot])
+                    continue;
+                GLuint64 ns = 0;
+                glGetQueryObjectui64v(queries[p][slot], GL_QUERY_RESULT, &ns);
+                profiler->recordLate(phases[p], profiled_frame[slot], ns * 1e-6);
+            }
+            discard(slot);
+            oldest++;
+        }
+    }
+
+    bool ready(int slot) const
+    {
+        for (size_t p = 0; p < queries.size(); p++) {
+            if (!issued[p][slot])
+                continue;
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(queries[p][slot], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available == GL_FALSE)
+                return false;
+        }
+        return true;
+    }
+
+    void discard(int slot)
+    {
+        for (size_t p = 0; p < issued.size(); p++)
+            issued[p][slot] = false;
+    }
+};
+
+#endif
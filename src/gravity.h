@@ -0,0 +1,13 @@
+#ifndef GRAVITY_H
+#define GRAVITY_H
+
+// Mutual attraction between particles, each of mass ParticleStore::weight.
+// Every solver gives particle i the acceleration
+//   constant * sum over j of m_j * (x_j - x_i) / (|x_j - x_i|^2 + softening^2)^1.5
+// (Plummer softening), so close encounters stay finite.
+struct GravityParams {
+    float constant;
+    float softening;
+};
+
+#endif
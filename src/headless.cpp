@@ -0,0 +1,422 @@
+// Runs the particle simulation without a window or GL context, for benchmarks
+// and soak tests on machines without a display.
+// usage: particles_headless [--steps N] [--capacity N] [--max-capacity N] [--huge-pages] [--threads N] [--report N] [--seed N] [--rate N] [--emitters N] [--obstacle] [--ground] [--bounds] [--grid] [--reorder K] [--depth-sort exact|buckets] [--sph] [--drag D] [--galaxy N] [--gravity uniform|direct|tree|mesh] [--check-gravity] [--theta T] [--mesh N] [--block-levels N] [--prewarm SECONDS] [--profile file.csv] [--verify]
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "FileSystem.h"
+#include "particle_system.h"
+
+// a grid of small sources cycling through every shape, to load the emitter path
+static void addEmitterField(ParticleSystem &system, int count)
+{
+    const EmitterShape shapes[] = {EMITTER_POINT, EMITTER_BOX, EMITTER_SPHERE, EMITTER_DISK, EMITTER_CONE};
+    int side = (int)std::ceil(std::sqrt((float)count));
+    for (int i = 0; i < count; i++) {
+        Emitter emitter;
+        emitter.shape = shapes[i % 5];
+        emitter.position = glm::vec3((i % side) * 0.5f, 0.0f, (i / side) * 0.5f);
+        emitter.direction = glm::vec3(0.0f, 1.0f, 0.0f);
+        emitter.extent = glm::vec3(0.2f);
+        emitter.radius = 0.2f;
+        emitter.speed_min = 2.0f;
+        emitter.speed_max = 4.0f;
+        emitter.velocity_spread = 0.2f;
+        emitter.life_min = 1.0f;
+        emitter.life_max = 2.0f;
+        emitter.rate = 600.0f;
+        system.addEmitter(emitter);
+    }
+}
+
+// a closed box where the fountain comes down, outward facing triangles
+static void boxMesh(const glm::vec3 &center, const glm::vec3 &half,
+                    std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indices)
+{
+    // corner c has +half on x if bit 0 is set, on y for bit 1, on z for bit 2
+    for (int c = 0; c < 8; c++) {
+        vertices.push_back(center + glm::vec3(c & 1 ? half.x : -half.x,
+                                              c & 2 ? half.y : -half.y,
+                                              c & 4 ? half.z : -half.z));
+    }
+    const unsigned int faces[36] = {
+        0, 4, 6, 0, 6, 2,   1, 3, 7, 1, 7, 5,
+        0, 1, 5, 0, 5, 4,   2, 6, 7, 2, 7, 3,
+        0, 2, 3, 0, 3, 1,   4, 5, 7, 4, 7, 6
+    };
+    indices.assign(faces, faces + 36);
+}
+
+// the triangles of a Wavefront OBJ file, polygons split into fans; only the
+// positions are read
+static bool loadObj(const std::string &path, std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indices)
+{
+    std::ifstream file(path.c_str());
+    if (!file) {
+        std::cout << "ERROR::HEADLESS::OBJ_NOT_FOUND " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream words(line);
+        std::string kind;
+        words >> kind;
+        if (kind == "v") {
+            glm::vec3 v;
+            words >> v.x >> v.y >> v.z;
+            vertices.push_back(v);
+        } else if (kind == "f") {
+            // "i", "i/t", "i//n" or "i/t/n"; negative indices count from the end
+            std::vector<unsigned int> corners;
+            std::string corner;
+            while (words >> corner) {
+                int index = atoi(corner.c_str());
+                corners.push_back(index < 0 ? (unsigned int)((int)vertices.size() + index) : (unsigned int)(index - 1));
+            }
+            for (size_t c = 2; c < corners.size(); c++) {
+                indices.push_back(corners[0]);
+                indices.push_back(corners[c - 1]);
+                indices.push_back(corners[c]);
+            }
+        }
+    }
+    return !indices.empty();
+}
+
+int main(int argc, char **argv) {
+    int steps = 3600;
+    int capacity = 3000000;
+    int max_capacity = 0;
+    bool huge_pages = false;
+    int threads = 0;
+    int report = 600;
+    unsigned long long seed = 1;
+    float fountain_rate = -1.0f;
+    int extra_emitters = 0;
+    bool obstacle = false;
+    bool ground = false;
+    bool bounds = false;
+    bool grid = false;
+    int reorder = 0;
+    const char *depth_mode = NULL;
+    bool sph = false;
+    float drag = 0.0f;
+    int galaxy = 0;
+    const char *gravity_model = NULL;
+    float theta = -1.0f;
+    int mesh = 0;
+    int block_levels = -1;
+    bool check_gravity = false;
+    float prewarm = -1.0f;
+    bool verify = false;
+    const char *profile_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--steps") == 0 && has_value)
+            steps = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--capacity") == 0 && has_value)
+            capacity = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--max-capacity") == 0 && has_value)
+            max_capacity = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--huge-pages") == 0)
+            huge_pages = true;
+        else if (std::strcmp(argv[i], "--threads") == 0 && has_value)
+            threads = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--report") == 0 && has_value)
+            report = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--seed") == 0 && has_value)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (std::strcmp(argv[i], "--rate") == 0 && has_value)
+            fountain_rate = (float)atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--emitters") == 0 && has_value)
+            extra_emitters = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--obstacle") == 0)
+            obstacle = true;
+        else if (std::strcmp(argv[i], "--ground") == 0)
+            ground = true;
+        else if (std::strcmp(argv[i], "--bounds") == 0)
+            bounds = true;
+        else if (std::strcmp(argv[i], "--grid") == 0)
+            grid = true;
+        else if (std::strcmp(argv[i], "--reorder") == 0 && has_value)
+            reorder = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--depth-sort") == 0 && has_value)
+            depth_mode = argv[++i];
+        else if (std::strcmp(argv[i], "--sph") == 0)
+            sph = true;
+        else if (std::strcmp(argv[i], "--drag") == 0 && has_value)
+            drag = (float)atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--galaxy") == 0 && has_value)
+            galaxy = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--gravity") == 0 && has_value)
+            gravity_model = argv[++i];
+        else if (std::strcmp(argv[i], "--theta") == 0 && has_value)
+            theta = (float)atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--mesh") == 0 && has_value)
+            mesh = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--block-levels") == 0 && has_value)
+            block_levels = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--check-gravity") == 0)
+            check_gravity = true;
+        else if (std::strcmp(argv[i], "--prewarm") == 0 && has_value)
+            prewarm = (float)atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--profile") == 0 && has_value)
+            profile_path = argv[++i];
+        else if (std::strcmp(argv[i], "--verify") == 0)
+            verify = true;
+        else {
+            std::cout << "usage: particles_headless [--steps N] [--capacity N] [--max-capacity N] [--huge-pages] [--threads N] [--report N] [--seed N] [--rate N] [--emitters N] [--obstacle] [--ground] [--bounds] [--grid] [--reorder K] [--depth-sort exact|buckets] [--sph] [--drag D] [--galaxy N] [--gravity uniform|direct|tree|mesh] [--check-gravity] [--theta T] [--mesh N] [--block-levels N] [--prewarm SECONDS] [--profile file.csv] [--verify]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (verify) {
+        // every SIMD kernel must match the scalar reference bit for bit
+        bool kernels_ok = verifyIntegrateKernels();
+        std::cout << "kernel verification " << (kernels_ok ? "passed" : "FAILED") << std::endl;
+        bool store_ok = verifyParticleStore();
+        std::cout << "particle store verification " << (store_ok ? "passed" : "FAILED") << std::endl;
+        bool random_ok = verifyRandomBatch();
+        std::cout << "random batch verification " << (random_ok ? "passed" : "FAILED") << std::endl;
+        bool grid_ok = verifySpatialGrid();
+        std::cout << "spatial grid verification " << (grid_ok ? "passed" : "FAILED") << std::endl;
+        bool direct_ok = verifyDirectSum();
+        std::cout << "direct sum verification " << (direct_ok ? "passed" : "FAILED") << std::endl;
+        bool tree_ok = verifyBarnesHut();
+        std::cout << "barnes-hut verification " << (tree_ok ? "passed" : "FAILED") << std::endl;
+        bool mesh_ok = verifyParticleMesh();
+        std::cout << "particle mesh verification " << (mesh_ok ? "passed" : "FAILED") << std::endl;
+        bool morton_ok = verifyMortonOrder();
+        std::cout << "morton order verification " << (morton_ok ? "passed" : "FAILED") << std::endl;
+        bool depth_ok = verifyDepthSort();
+        std::cout << "depth sort verification " << (depth_ok ? "passed" : "FAILED") << std::endl;
+        return kernels_ok && store_ok && random_ok && grid_ok && direct_ok && tree_ok && mesh_ok && morton_ok && depth_ok ? 0 : 1;
+    }
+
+    ParticleSystem system(capacity, threads, max_capacity, huge_pages);
+    system.seed(seed);
+    if (gravity_model != NULL) {
+        // the particles pull on each other instead of falling
+        if (std::strcmp(gravity_model, "direct") == 0)
+            system.mutual_gravity = MUTUAL_GRAVITY_DIRECT;
+        else if (std::strcmp(gravity_model, "tree") == 0)
+            system.mutual_gravity = MUTUAL_GRAVITY_BARNES_HUT;
+        else if (std::strcmp(gravity_model, "mesh") == 0)
+            system.mutual_gravity = MUTUAL_GRAVITY_PARTICLE_MESH;
+        else if (std::strcmp(gravity_model, "uniform") != 0) {
+            std::cout << "ERROR::HEADLESS::UNKNOWN_GRAVITY " << gravity_model << std::endl;
+            return 1;
+        }
+        if (system.mutual_gravity != MUTUAL_GRAVITY_NONE)
+            system.gravity = glm::vec3(0.0f);
+    }
+    if (sph) {
+        // water poured onto the lid of the teapot, spreading over the ground
+        // quad and kept in by walls at its edges
+        system.pour(glm::vec3(3.5f, 12.0f, 0.0f), 0.5f, 3.0f, 60.0f);
+        ground = bounds = true;
+    }
+    if (galaxy > 0) {
+        // stars of a disk 20 units across, the edge going round in about 30 s
+        int stars = system.spawnGalaxy(galaxy, glm::vec3(0.0f), 10.0f, 50.0f);
+        std::cout << "galaxy of " << stars << " stars" << std::endl;
+    }
+    system.drag = drag;
+    system.morton.interval = reorder;
+    if (depth_mode != NULL) {
+        if (std::strcmp(depth_mode, "buckets") == 0)
+            system.depth_sort.mode = DEPTH_SORT_BUCKETS;
+        else if (std::strcmp(depth_mode, "exact") != 0) {
+            std::cout << "ERROR::HEADLESS::UNKNOWN_DEPTH_SORT " << depth_mode << std::endl;
+            return 1;
+        }
+    }
+    if (theta >= 0.0f)
+        system.barnes_hut.theta = theta;
+    if (mesh > 0)
+        system.particle_mesh.size = mesh;
+    if (block_levels >= 0)
+        system.blocks.max_level = std::min(block_levels, 30);
+    if (fountain_rate >= 0.0f && !system.emitters.empty())
+        system.emitters[0].rate = fountain_rate;
+    addEmitterField(system, extra_emitters);
+
+    if (ground) {
+        // the ground quad of the window app
+        CollisionPlane plane = {glm::vec3(0.0f, 1.0f, 0.0f), -0.5f};
+        system.planes.push_back(plane);
+    }
+    if (bounds) {
+        CollisionPlane walls[6];
+        boxBoundary(glm::vec3(-20.0f, -0.5f, -20.0f), glm::vec3(20.0f, 40.0f, 20.0f), walls);
+        system.planes.insert(system.planes.end(), walls, walls + 6);
+    }
+
+    system.build_grid = grid;
+
+    DistanceField teapot_field;
+    if (sph) {
+        // as main.cpp places it: a tenth of its size, tilted by 30 degrees
+        std::vector<glm::vec3> vertices;
+        std::vector<unsigned int> indices;
+        if (loadObj(FileSystem::getPath("resource/obj/teapot/teapot.obj"), vertices, indices)) {
+            const float c = std::cos(glm::radians(-30.0f)), s = std::sin(glm::radians(-30.0f));
+            for (size_t v = 0; v < vertices.size(); v++) {
+                glm::vec3 p = vertices[v] * 0.1f;
+                vertices[v] = glm::vec3(c * p.x - s * p.y, s * p.x + c * p.y, p.z);
+            }
+            std::chrono::steady_clock::time_point bake_start = std::chrono::steady_clock::now();
+            if (teapot_field.bake(vertices, indices, 0.05f, 0.2f, system.pool))
+                system.collider = &teapot_field;
+            std::chrono::duration<double, std::milli> bake_ms = std::chrono::steady_clock::now() - bake_start;
+            std::cout << "teapot baked in " << bake_ms.count() << " ms, " << indices.size() / 3 << " triangles"
+                      << std::endl;
+        }
+    }
+    DistanceField obstacle_field;
+    if (obstacle) {
+        std::vector<glm::vec3> vertices;
+        std::vector<unsigned int> indices;
+        boxMesh(glm::vec3(14.0f, -2.0f, 0.0f), glm::vec3(1.5f), vertices, indices);
+        std::chrono::steady_clock::time_point bake_start = std::chrono::steady_clock::now();
+        if (obstacle_field.bake(vertices, indices, 0.05f, 0.2f, system.pool))
+            system.collider = &obstacle_field;
+        std::chrono::duration<double, std::milli> bake_ms = std::chrono::steady_clock::now() - bake_start;
+        std::cout << "obstacle baked in " << bake_ms.count() << " ms, " << obstacle_field.values.size() / 512
+                  << " of " << obstacle_field.bricks.size() << " bricks stored" << std::endl;
+    }
+    // measure steady state from the first step; --prewarm 0 starts from an empty pool
+    std::chrono::steady_clock::time_point prewarm_start = std::chrono::steady_clock::now();
+    int prewarm_steps = system.prewarm(prewarm);
+    std::chrono::duration<double, std::milli> prewarm_ms = std::chrono::steady_clock::now() - prewarm_start;
+    FrameProfiler profiler;
+    system.setProfiler(&profiler);
+    std::cout << "kernel " << system.kernel.name << ", " << system.pool.size() << " threads, capacity "
+              << capacity << ", " << steps << " steps of " << system.timestep.step << " s" << std::endl;
+    std::cout << "pool " << system.particles.capacity << " of " << system.particles.max_capacity << " slots, "
+              << (system.particles.huge_pages ? "explicit" : huge_pages ? "transparent" : "regular") << " pages" << std::endl;
+    std::cout << "prewarm " << prewarm_steps << " steps in " << prewarm_ms.count() << " ms, "
+              << system.aliveCount() << " alive" << std::endl;
+
+    double total_ms = 0.0;
+    double window_ms = 0.0;
+    long long updated = 0;
+    double depth_ms = 0.0;
+    int depth_coherent = 0;
+    for (int s = 1; s <= steps; s++) {
+        updated += system.aliveCount();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        profiler.beginFrame();
+        // exactly one fixed step per iteration, positions written as for a rendered frame
+        system.update(system.timestep.step);
+        profiler.endFrame();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        total_ms += elapsed.count();
+        window_ms += elapsed.count();
+        if (depth_mode != NULL) {
+            // back to front for the default camera of the window app
+            std::chrono::steady_clock::time_point sort_start = std::chrono::steady_clock::now();
+            system.sortPositions(glm::vec3(0.0f, 5.0f, 30.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+            std::chrono::duration<double, std::milli> sort_elapsed = std::chrono::steady_clock::now() - sort_start;
+            depth_ms += sort_elapsed.count();
+            depth_coherent += system.depth_sort.coherent;
+        }
+
+        if (report > 0 && s % report == 0) {
+            std::cout << "step " << s << ": " << system.aliveCount() << " alive, "
+                      << system.sleepingCount() << " asleep, "
+                      << window_ms / report << " ms/step" << std::endl;
+            window_ms = 0.0;
+        }
+    }
+
+    std::cout << "total " << total_ms << " ms, " << total_ms / steps << " ms/step, "
+              << updated / (total_ms * 1000.0) << " Mparticles/s" << std::endl;
+    if (depth_mode != NULL) {
+        std::cout << "depth sort (" << depth_mode << ") " << depth_ms / steps << " ms/frame, " << depth_coherent
+                  << " of " << steps << " frames repaired from the last order" << std::endl;
+    }
+    if (grid) {
+        // neighbours of a sample of the particles, as an analysis pass would ask
+        int queries = std::min(system.aliveCount(), 10000);
+        const ParticleStore &p = system.particles;
+        std::vector<int> offsets, neighbours;
+        std::vector<int> nearest(8 * (size_t)queries);
+        std::chrono::steady_clock::time_point query_start = std::chrono::steady_clock::now();
+        system.grid.radiusBatch(system.pool, p.pos_x, p.pos_y, p.pos_z, queries, 0.1f, offsets, neighbours);
+        std::chrono::steady_clock::time_point knn_start = std::chrono::steady_clock::now();
+        system.grid.nearestBatch(system.pool, p.pos_x, p.pos_y, p.pos_z, queries, 8, 0.4f, nearest.data(), NULL);
+        std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::milli> radius_ms = knn_start - query_start, knn_ms = done - knn_start;
+        std::cout << queries << " radius 0.1 queries in " << radius_ms.count() << " ms, "
+                  << (double)neighbours.size() / std::max(queries, 1) << " neighbours each; 8-nearest within 0.4 in "
+                  << knn_ms.count() << " ms" << std::endl;
+    }
+    if (system.mutual_gravity != MUTUAL_GRAVITY_NONE) {
+        // how much the block timesteps saved over giving every body a force every step
+        std::vector<int> levels = system.blocks.histogram(system.particles);
+        std::cout << (double)system.blocks.evaluations / std::max(updated, 1ll) << " forces per body step; bodies by level:";
+        for (size_t l = 0; l < levels.size(); l++)
+            std::cout << " " << levels[l];
+        std::cout << std::endl;
+    }
+    if (check_gravity && system.mutual_gravity != MUTUAL_GRAVITY_NONE) {
+        // the solver's forces on the final state against the exact ones
+        const int count = system.particles.alive_count;
+        std::vector<float> ax(count), ay(count), az(count), ex(count), ey(count), ez(count);
+        switch (system.mutual_gravity) {
+        case MUTUAL_GRAVITY_NONE:
+        case MUTUAL_GRAVITY_DIRECT:
+            system.direct_sum.accelerations(system.pool, system.particles, system.gravitation, ax.data(), ay.data(), az.data());
+            break;
+        case MUTUAL_GRAVITY_BARNES_HUT:
+            system.barnes_hut.build(system.pool, system.particles);
+            system.barnes_hut.accelerations(system.pool, system.gravitation, ax.data(), ay.data(), az.data());
+            break;
+        case MUTUAL_GRAVITY_PARTICLE_MESH:
+            system.particle_mesh.accelerations(system.pool, system.particles, system.gravitation, ax.data(), ay.data(), az.data());
+            break;
+        }
+        std::chrono::steady_clock::time_point exact_start = std::chrono::steady_clock::now();
+        system.direct_sum.accelerations(system.pool, system.particles, system.gravitation, ex.data(), ey.data(), ez.data());
+        std::chrono::duration<double, std::milli> exact_ms = std::chrono::steady_clock::now() - exact_start;
+        double error2 = 0.0, norm2 = 0.0;
+        for (int i = 0; i < count; i++) {
+            error2 += (ax[i] - ex[i]) * (ax[i] - ex[i]) + (ay[i] - ey[i]) * (ay[i] - ey[i]) + (az[i] - ez[i]) * (az[i] - ez[i]);
+            norm2 += ex[i] * ex[i] + ey[i] * ey[i] + ez[i] * ez[i];
+        }
+        std::cout << "gravity off the direct sum by " << std::sqrt(error2 / std::max(norm2, 1e-30)) << " rms; direct sum ("
+                  << system.direct_sum.kernel.name << ") took " << exact_ms.count() << " ms" << std::endl;
+    }
+    if (system.mutual_gravity == MUTUAL_GRAVITY_BARNES_HUT) {
+        std::cout << "octree of " << system.barnes_hut.nodes.size() << " nodes, " << system.barnes_hut.leaves.size()
+                  << " leaves, theta " << system.barnes_hut.theta << std::endl;
+    }
+    if (system.mutual_gravity == MUTUAL_GRAVITY_PARTICLE_MESH) {
+        std::cout << "mesh of " << system.particle_mesh.size << "^3 points " << system.particle_mesh.spacing
+                  << " apart" << std::endl;
+    }
+    if (system.collider != NULL) {
+        int inside = 0;
+        for (int i = 0; i < system.particles.alive_count; i++) {
+            glm::vec3 p(system.particles.pos_x[i], system.particles.pos_y[i], system.particles.pos_z[i]);
+            if (system.collider->sample(p) < 0.0f)
+                inside++;
+        }
+        std::cout << inside << " particles inside the obstacle" << std::endl;
+    }
+    std::cout << "seed " << seed << ", state hash " << std::hex << system.stateHash() << std::dec << std::endl;
+    std::cout << profiler.summary();
+    if (profile_path != NULL && !profiler.writeCsv(profile_path))
+        return 1;
+    return 0;
+}
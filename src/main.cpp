@@ -1,3 +1,5 @@
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <algorithm>
@@ -24,6 +26,8 @@
 
 // for data 
 #include "data.h"
+#include "particle_system.h"
+#include "gpu_timer.h"
 
 // window size 
 const unsigned int SCR_WIDTH = 1280;
@@ -44,38 +48,18 @@ float lastFrame = 0.0f;
 // light Position 
 glm::vec3 light_position(0.0f, 50.0f, 40.0f);
 
-// squre amount 
-const int amount = 3000000;
-// position array 
-Square square_container[amount];
-glm::vec3 square_position_buffer[amount];
-// last used number 
-int last_unused_index = 0;
-
-int findUnusedIndex() {
-    // find last use index of particle 
-    for (int i=last_unused_index; i<amount; i++) {
-        if (square_container[i].life < 0) {
-            last_unused_index = i;
-            return i;
-        }
-    }
-
-    // Check the index upside down
-    for (int i=0; i<last_unused_index; i++) {
-        if (square_container[i].life < 0) {
-            last_unused_index = i;
-            return i;
-        } 
-    }
-
-    // if not, return 0
-    return 0;
-}
-
-void sortSquare() {
-    std::sort(&square_container[0], &square_container[amount]);
-}
+// particle pool, set from the command line:
+// [--capacity N] [--max-capacity N] [--huge-pages] [--sph] [--galaxy N] [--gravity direct|tree|mesh]
+// [--depth-sort exact|buckets|off]
+int capacity = 65536;
+int max_capacity = 3000000;
+bool huge_pages = false;
+bool sph = false;
+int galaxy = 0;
+MutualGravity mutual_gravity = MUTUAL_GRAVITY_NONE;
+// the particles are blended, so they are drawn back to front unless told not to
+bool depth_sorted = true;
+DepthSortMode depth_mode = DEPTH_SORT_EXACT;
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
     glViewport(0, 0, width, height);
@@ -185,7 +169,49 @@ unsigned int loadTexture(const char *path) {
     return textureID;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--capacity") == 0 && has_value)
+            capacity = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--max-capacity") == 0 && has_value)
+            max_capacity = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--huge-pages") == 0)
+            huge_pages = true;
+        else if (std::strcmp(argv[i], "--sph") == 0)
+            sph = true;
+        else if (std::strcmp(argv[i], "--galaxy") == 0 && has_value)
+            galaxy = atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--gravity") == 0 && has_value) {
+            const char *model = argv[++i];
+            if (std::strcmp(model, "direct") == 0)
+                mutual_gravity = MUTUAL_GRAVITY_DIRECT;
+            else if (std::strcmp(model, "tree") == 0)
+                mutual_gravity = MUTUAL_GRAVITY_BARNES_HUT;
+            else if (std::strcmp(model, "mesh") == 0)
+                mutual_gravity = MUTUAL_GRAVITY_PARTICLE_MESH;
+            else {
+                std::cout << "ERROR::MAIN::UNKNOWN_GRAVITY " << model << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--depth-sort") == 0 && has_value) {
+            const char *mode = argv[++i];
+            if (std::strcmp(mode, "exact") == 0)
+                depth_mode = DEPTH_SORT_EXACT;
+            else if (std::strcmp(mode, "buckets") == 0)
+                depth_mode = DEPTH_SORT_BUCKETS;
+            else if (std::strcmp(mode, "off") == 0)
+                depth_sorted = false;
+            else {
+                std::cout << "ERROR::MAIN::UNKNOWN_DEPTH_SORT " << mode << std::endl;
+                return 1;
+            }
+        } else {
+            std::cout << "usage: excute_file [--capacity N] [--max-capacity N] [--huge-pages] [--sph] [--galaxy N] [--gravity direct|tree|mesh] [--depth-sort exact|buckets|off]" << std::endl;
+            return 1;
+        }
+    }
+
     // GL init 
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -227,11 +253,74 @@ int main() {
     Shader teapot_shader("../shader/Teapot/teapot_vs.glsl", "../shader/Teapot/teapot_fs.glsl");
     Shader shader("../shader/vertex_shader.glsl", "../shader/fragment_shader.glsl");
 
-    // init square
-    for (int i=0; i<amount; i++) {
-        square_container[i].life = -1.0f;
-        square_container[i].up = 0;
+    // particle simulation 
+    ParticleSystem particle_system(capacity, 0, max_capacity, huge_pages);
+    std::cout << "particle kernel: " << particle_system.kernel.name << std::endl;
+    particle_system.depth_sort.mode = depth_mode;
+    // the water comes to rest on the ground quad of planeVertices
+    CollisionPlane ground = {glm::vec3(0.0f, 1.0f, 0.0f), planeVertices[1]};
+    particle_system.planes.push_back(ground);
+    if (sph) {
+        // SPH water poured onto the lid instead of the fountain, walled in at
+        // the edges of the ground quad
+        particle_system.pour(glm::vec3(3.5f, 12.0f, 0.0f), 0.5f, 3.0f, 60.0f);
+        CollisionPlane walls[6];
+        boxBoundary(glm::vec3(-20.0f, planeVertices[1], -20.0f), glm::vec3(20.0f, 40.0f, 20.0f), walls);
+        particle_system.planes.insert(particle_system.planes.end(), walls, walls + 6);
+    }
+    if (mutual_gravity != MUTUAL_GRAVITY_NONE) {
+        // the particles pull on each other instead of falling
+        particle_system.mutual_gravity = mutual_gravity;
+        particle_system.gravity = glm::vec3(0.0f);
+    }
+    if (galaxy > 0) {
+        // a disk galaxy of self-gravitating stars floating above the teapot,
+        // free of the ground and the fountain
+        particle_system.planes.clear();
+        particle_system.spawnGalaxy(galaxy, glm::vec3(0.0f, 20.0f, 0.0f), 10.0f, 50.0f);
+    }
+
+    // per-phase frame timing, dumped on exit 
+    FrameProfiler profiler;
+    int phase_input = profiler.phase("input");
+    particle_system.setProfiler(&profiler);
+    int phase_depth_sort = profiler.phase("depth_sort");
+    int phase_upload = profiler.phase("upload");
+    int phase_particle_draw = profiler.phase("particle_draw");
+    int phase_teapot_draw = profiler.phase("teapot_draw");
+    int phase_skybox_draw = profiler.phase("skybox_draw");
+    int phase_swap = profiler.phase("swap");
+    GpuTimer gpu_timer(&profiler);
+    int pass_particles = gpu_timer.pass("particle_draw");
+    int pass_teapot = gpu_timer.pass("teapot_draw");
+    int pass_skybox = gpu_timer.pass("skybox_draw");
+
+    Model teapot(FileSystem::getPath("resource/obj/teapot/teapot.obj"));
+    glm::mat4 teapot_model = glm::mat4(1.0f);
+    teapot_model = glm::translate(teapot_model, glm::vec3(0.0f, 0.0f, 0.0f));
+    teapot_model = glm::scale(teapot_model, glm::vec3(1.0f, 1.0f, 1.0f));
+    teapot_model = glm::rotate(teapot_model, glm::radians(-30.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+
+    // the water bounces off the teapot: bake its triangles, in world space,
+    // into a distance field the particle update can sample. teapot_vs draws
+    // the mesh at a tenth of its size, so the field does too
+    std::vector<glm::vec3> teapot_vertices;
+    std::vector<unsigned int> teapot_indices;
+    for (size_t m = 0; m < teapot.meshes.size(); m++) {
+        const Mesh &mesh = teapot.meshes[m];
+        unsigned int base = (unsigned int)teapot_vertices.size();
+        for (size_t v = 0; v < mesh.vertices.size(); v++)
+            teapot_vertices.push_back(glm::vec3(teapot_model * glm::vec4(mesh.vertices[v].Position * 0.1f, 1.0f)));
+        for (size_t i = 0; i < mesh.indices.size(); i++)
+            teapot_indices.push_back(base + mesh.indices[i]);
     }
+    DistanceField teapot_field;
+    if (galaxy == 0 && teapot_field.bake(teapot_vertices, teapot_indices, 0.05f, 0.2f, particle_system.pool))
+        particle_system.collider = &teapot_field;
+
+    // start at steady state instead of an empty fountain; the pour starts dry
+    if (!sph && galaxy == 0)
+        particle_system.prewarm();
 
     // binding VAO
     unsigned int pVAO;
@@ -255,12 +344,11 @@ int main() {
     unsigned int square_position_data_buffer;
     glGenBuffers(1, &square_position_data_buffer);
     glBindBuffer(GL_ARRAY_BUFFER, square_position_data_buffer);
-    // glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * amount, &square_position_buffer[0], GL_DYNAMIC_DRAW);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * amount, NULL, GL_DYNAMIC_DRAW);
+    // sized for the live particles, with headroom; grown when the pool outgrows it
+    int gl_capacity = particle_system.positionCount() + particle_system.positionCount() / 4 + 1024;
+    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * gl_capacity, NULL, GL_STREAM_DRAW);
     glBindVertexArray(0);
 
-    Model teapot(FileSystem::getPath("resource/obj/teapot/teapot.obj"));
-
     // skybox VAO
     unsigned int skyboxVAO, skyboxVBO;
     glGenVertexArrays(1, &skyboxVAO);
@@ -321,11 +409,16 @@ int main() {
     cube_map_shader.setInt("skybox", 0);
 
     while (!glfwWindowShouldClose(window)) {
+        profiler.beginFrame();
+        gpu_timer.beginFrame();
         float currentFrame = static_cast<float>(glfwGetTime());
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
 
-        processInput(window);
+        {
+            ScopedTimer timer(&profiler, phase_input);
+            processInput(window);
+        }
 
         glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -334,42 +427,13 @@ int main() {
         glm::mat4 view = camera.GetViewMatrix();
         glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
 
-        int new_square = (int)(deltaTime * 10000.0);
-        if (new_square > (int)(0.016f * 10000.0))
-            new_square = (int)(0.016f * 10000.0);
-
-
-        float spread = 1.5f;
-        for (int i=0; i<new_square; i++) {
-            int square_idx = findUnusedIndex();
-            square_container[square_idx].life = 5.0f;
-            square_container[square_idx].pos = glm::vec3(9.0f, 1.5f, 0.0f);
-            square_container[square_idx].up = 0;
-
-            glm::vec3 main_dir = glm::vec3(5.0f, 1.0f, 0.0f);
-            glm::vec3 rand_dir = glm::vec3(
-                    (rand()%2000 - 1000.0f)/1000.0f,
-                    (rand()%2000 - 1000.0f)/1000.0f,
-                    (rand()%2000 - 1000.0f)/1000.0f
-            );
-
-            square_container[square_idx].speed = main_dir + rand_dir * spread;
-        }
-
-        int square_counter = 0;
-        for (int i=0; i<amount; i++) {
-            Square &sq = square_container[i];
-
-            if (sq.life > 0.0f) {
-                sq.life -= deltaTime;
-                if (sq.life > 0.0f) {
-                    sq.speed += glm::vec3(0.0f, -9.81f, 0.0f) * (float)deltaTime * 0.5f;
-                    sq.pos += sq.speed * (float)deltaTime;
-
-                    square_position_buffer[square_counter] = sq.pos;
-                }
-                square_counter++;
-            }
+        particle_system.update(deltaTime);
+        int square_counter = particle_system.positionCount();
+        const float *square_positions = particle_system.positions();
+        if (depth_sorted) {
+            ScopedTimer timer(&profiler, phase_depth_sort);
+            square_counter = particle_system.sortPositions(camera.Position, camera.Front);
+            square_positions = particle_system.sortedPositions();
         }
 
 
@@ -385,63 +449,94 @@ int main() {
         shader.setVec3("lightPos", light_position);
 
         glBindVertexArray(pVAO);
-        // draw plane 
-        glBindBuffer(GL_ARRAY_BUFFER, square_position_data_buffer);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * amount, NULL, GL_DYNAMIC_DRAW);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, square_counter * sizeof(glm::vec3), square_position_buffer);
-
-        glEnableVertexAttribArray(3);
-        glBindBuffer(GL_ARRAY_BUFFER, square_position_data_buffer);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*) 0);
-        glVertexAttribDivisor(3, 1); 
-
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, water_texture);
-
-        glDrawArraysInstanced(GL_TRIANGLES, 0, 36, square_counter);
-
-        teapot_shader.use();
-        teapot_shader.setVec3("light.position", light_position);
-        teapot_shader.setVec3("viewPos", camera.Position);
-        teapot_shader.setVec3("lightPos", light_position);
-        teapot_shader.setVec3("lightColor", glm::vec3(0.0f, 1.0f, 1.0f));
-        teapot_shader.setVec3("light.ambient", 0.2f, 0.2f, 0.2f);
-        teapot_shader.setVec3("light.diffuse", 0.5f, 0.5f, 0.5f);
-        teapot_shader.setVec3("light.specular", 1.0f, 1.0f, 1.0f);
-
-        // material properties
-        teapot_shader.setFloat("material.shininess", 64.0f);
-        teapot_shader.setMat4("projection", projection);
-        teapot_shader.setMat4("view", view);
-        glm::mat4 teapot_model = glm::mat4(1.0f);
-        teapot_model = glm::translate(teapot_model, glm::vec3(0.0f, 0.0f, 0.0f));
-        teapot_model = glm::scale(teapot_model, glm::vec3(1.0f, 1.0f, 1.0f));
-        teapot_model = glm::rotate(teapot_model, glm::radians(-30.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-        teapot_shader.setMat4("model", teapot_model);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubmap_texture);
-        teapot.Draw(teapot_shader);
-        glBindVertexArray(0);
-
-        // draw skybox as last
-        glDepthFunc(GL_LEQUAL);
-        cube_map_shader.use();
-        view = glm::mat4(glm::mat3(camera.GetViewMatrix()));
-        cube_map_shader.setMat4("view", view);
-        cube_map_shader.setMat4("projection", projection);
-
-        // skybox cube 
-        glBindVertexArray(skyboxVAO);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubmap_texture);
-        glDrawArrays(GL_TRIANGLES, 0, 36);
-        glBindVertexArray(0);
-        glDepthFunc(GL_LESS);
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        {
+            ScopedTimer timer(&profiler, phase_upload);
+            // draw plane 
+            glBindBuffer(GL_ARRAY_BUFFER, square_position_data_buffer);
+            if (square_counter > gl_capacity)
+                gl_capacity = square_counter + square_counter / 2;
+            // orphan the buffer, then upload only the live range rather than the whole pool
+            glBufferData(GL_ARRAY_BUFFER, gl_capacity * sizeof(glm::vec3), NULL, GL_STREAM_DRAW);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, square_counter * sizeof(glm::vec3), square_positions);
+        }
+
+        {
+            ScopedTimer timer(&profiler, phase_particle_draw);
+            glEnableVertexAttribArray(3);
+            glBindBuffer(GL_ARRAY_BUFFER, square_position_data_buffer);
+            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*) 0);
+            glVertexAttribDivisor(3, 1); 
+
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, water_texture);
+
+            gpu_timer.begin(pass_particles);
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 36, square_counter);
+            gpu_timer.end(pass_particles);
+        }
+
+        {
+            ScopedTimer timer(&profiler, phase_teapot_draw);
+            teapot_shader.use();
+            teapot_shader.setVec3("light.position", light_position);
+            teapot_shader.setVec3("viewPos", camera.Position);
+            teapot_shader.setVec3("lightPos", light_position);
+            teapot_shader.setVec3("lightColor", glm::vec3(0.0f, 1.0f, 1.0f));
+            teapot_shader.setVec3("light.ambient", 0.2f, 0.2f, 0.2f);
+            teapot_shader.setVec3("light.diffuse", 0.5f, 0.5f, 0.5f);
+            teapot_shader.setVec3("light.specular", 1.0f, 1.0f, 1.0f);
+
+            // material properties
+            teapot_shader.setFloat("material.shininess", 64.0f);
+            teapot_shader.setMat4("projection", projection);
+            teapot_shader.setMat4("view", view);
+            teapot_shader.setMat4("model", teapot_model);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, cubmap_texture);
+            gpu_timer.begin(pass_teapot);
+            teapot.Draw(teapot_shader);
+            gpu_timer.end(pass_teapot);
+            glBindVertexArray(0);
+        }
+
+        {
+            ScopedTimer timer(&profiler, phase_skybox_draw);
+            // draw skybox as last
+            glDepthFunc(GL_LEQUAL);
+            cube_map_shader.use();
+            view = glm::mat4(glm::mat3(camera.GetViewMatrix()));
+            cube_map_shader.setMat4("view", view);
+            cube_map_shader.setMat4("projection", projection);
+
+            // skybox cube 
+            glBindVertexArray(skyboxVAO);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, cubmap_texture);
+            gpu_timer.begin(pass_skybox);
+            glDrawArrays(GL_TRIANGLES, 0, 36);
+            gpu_timer.end(pass_skybox);
+            glBindVertexArray(0);
+            glDepthFunc(GL_LESS);
+        }
+
+        {
+            ScopedTimer timer(&profiler, phase_swap);
+            glfwSwapBuffers(window);
+        }
+        {
+            ScopedTimer timer(&profiler, phase_input);
+            glfwPollEvents();
+        }
+        gpu_timer.endFrame();
+        profiler.endFrame();
     }
 
+    std::cout << profiler.summary();
+    if (gpu_timer.droppedFrames() > 0)
+        std::cout << "gpu timer dropped " << gpu_timer.droppedFrames() << " frames" << std::endl;
+    profiler.writeCsv("frame_profile.csv");
+
+    gpu_timer.release();
     glDeleteVertexArrays(1, &skyboxVAO);
     glDeleteBuffers(1, &skyboxVBO);
 
@@ -0,0 +1,131 @@
+#include "morton_order.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "particle_update.h"
+#include "random.h"
+
+MortonOrder::MortonOrder()
+    : interval(0), age(0)
+{
+}
+
+bool MortonOrder::due()
+{
+    if (interval <= 0)
+        return false;
+    if (++age < interval)
+        return false;
+    age = 0;
+    return true;
+}
+
+void MortonOrder::sort(ThreadPool &pool, ParticleStore &particles)
+{
+    const int count = particles.alive_count;
+    if (count < 2)
+        return;
+    codes.resize(count);
+    order.resize(count);
+
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    const float *pos[3] = {particles.pos_x, particles.pos_y, particles.pos_z};
+
+    // bounding cube of the live particles
+    std::vector<float> chunk_bounds(6 * (size_t)chunks);
+    pool.run(chunks, [&](int c) {
+        float *b = &chunk_bounds[6 * (size_t)c];
+        int begin = c * chunk, end = std::min(count, begin + chunk);
+        for (int axis = 0; axis < 3; axis++) {
+            const float *v = pos[axis];
+            b[axis] = *std::min_element(v + begin, v + end);
+            b[3 + axis] = *std::max_element(v + begin, v + end);
+        }
+    });
+    float lo[3], side = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        float hi = chunk_bounds[3 + axis];
+        lo[axis] = chunk_bounds[axis];
+        for (int c = 1; c < chunks; c++) {
+            lo[axis] = std::min(lo[axis], chunk_bounds[6 * (size_t)c + axis]);
+            hi = std::max(hi, chunk_bounds[6 * (size_t)c + 3 + axis]);
+        }
+        side = std::max(side, hi - lo[axis]);
+    }
+    side = side > 0.0f ? side * 1.0001f : 1.0f;
+    const float scale = (float)(1 << MORTON_BITS) / side;
+    const int top = (1 << MORTON_BITS) - 1;
+
+    // the awake bit on top keeps the sleepers in front
+    const int sleep_count = particles.sleep_count;
+    pool.run(chunks, [&](int c) {
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            unsigned int q[3];
+            for (int axis = 0; axis < 3; axis++)
+                q[axis] = (unsigned int)std::max(0, std::min(top, (int)((pos[axis][i] - lo[axis]) * scale)));
+            codes[i] = mortonCode(q[0], q[1], q[2]) | (i >= sleep_count ? 1u << (3 * MORTON_BITS) : 0u);
+            order[i] = i;
+        }
+    });
+    radixSortPairs(pool, codes, order, 3 * MORTON_BITS + 1, sort_buffers);
+    particles.permute(pool, order.data(), count);
+}
+
+// summed distance between the particles in neighbouring slots of [begin, end)
+static double pathLength(const ParticleStore &p, int begin, int end)
+{
+    double length = 0.0;
+    for (int i = begin + 1; i < end; i++) {
+        double dx = p.pos_x[i] - p.pos_x[i - 1], dy = p.pos_y[i] - p.pos_y[i - 1], dz = p.pos_z[i] - p.pos_z[i - 1];
+        length += std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+    return length;
+}
+
+bool verifyMortonOrder()
+{
+    // more than one chunk of the pool
+    const int count = 40000;
+    ParticleStore particles(count);
+    Random random(0x3047ull);
+    int first = 0;
+    particles.spawnBlock(count, &first);
+    for (int i = 0; i < count; i++) {
+        particles.pos_x[i] = 4.0f * random.symmetric();
+        particles.pos_y[i] = 4.0f * random.symmetric();
+        particles.pos_z[i] = 4.0f * random.symmetric();
+        particles.life[i] = (float)i;
+    }
+    for (int i = 0; i < count / 8; i++)
+        particles.sleep(particles.sleep_count + (int)(random.uniform() * (count - particles.sleep_count)));
+
+    // what every id holds, and which ids sleep
+    std::vector<float> x_of(count), life_of(count);
+    std::vector<unsigned char> asleep(count, 0);
+    for (int i = 0; i < count; i++) {
+        x_of[particles.ids[i]] = particles.pos_x[i];
+        life_of[particles.ids[i]] = particles.life[i];
+        asleep[particles.ids[i]] = i < particles.sleep_count;
+    }
+    const int sleep_count = particles.sleep_count;
+    const double before = pathLength(particles, sleep_count, count);
+
+    ThreadPool pool(2);
+    MortonOrder morton;
+    morton.sort(pool, particles);
+
+    if (particles.alive_count != count || particles.sleep_count != sleep_count)
+        return false;
+    for (int i = 0; i < count; i++) {
+        int id = particles.ids[i];
+        if (particles.slot_of[id] != i || particles.pos_x[i] != x_of[id] || particles.life[i] != life_of[id])
+            return false;
+        if ((i < sleep_count) != (asleep[id] != 0))
+            return false;
+    }
+    // a random order wanders across the whole box between slots; the curve
+    // steps to a near cell nearly every time
+    return pathLength(particles, sleep_count, count) < 0.2 * before;
+}
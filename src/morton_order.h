@@ -0,0 +1,65 @@
+#ifndef MORTON_ORDER_H
+#define MORTON_ORDER_H
+
+#include <vector>
+
+#include "particle_store.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
+
+// bits of a Morton code per axis; three axes fit a 32 bit radix sort key
+const int MORTON_BITS = 10;
+
+// spreads the low 10 bits of v to every third bit
+inline unsigned int expandBits(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Morton code of a cell of the 2^MORTON_BITS grid
+inline unsigned int mortonCode(unsigned int x, unsigned int y, unsigned int z)
+{
+    return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+// Keeps the particle store in Morton (Z) order of position.
+// Particles are stored in spawn order, so the neighbours the grid, the fluid
+// and collision look at are scattered over the arrays. Sorting the slots by the
+// Morton code of their cell in a grid over the bounding cube of the live
+// particles puts particles that are close in space close in memory, and the
+// spatial passes after it run through the arrays nearly in order.
+// The order decays as the particles move and new ones are appended, so the
+// sort is rerun every interval steps. Sleepers and awake particles are sorted
+// each among themselves, with the awake bit above the code as the top digit
+// of the same radix sort. Ids move with their particles, so anything that
+// holds ids stays valid; anything that holds slots must be rebuilt.
+class MortonOrder
+{
+public:
+    // steps between sorts; 0 never sorts
+    int interval;
+    // steps since the last sort
+    int age;
+
+    MortonOrder();
+
+    // counts a step; true when a sort is due
+    bool due();
+    // sorts the live particles
+    void sort(ThreadPool &pool, ParticleStore &particles);
+
+private:
+    std::vector<unsigned int> codes;
+    std::vector<int> order;
+    RadixSortBuffers sort_buffers;
+};
+
+// a sort must move every particle whole, ids included, keep the sleepers
+// asleep and leave neighbouring slots close in space
+bool verifyMortonOrder();
+
+#endif
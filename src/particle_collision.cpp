@@ -0,0 +1,103 @@
+#include "particle_collision.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "particle_update.h"
+
+// pushes particle i out to the contact radius and bounces it off a surface
+// with unit normal n, `distance` away from it
+static void respond(ParticleStore &p, int i, const glm::vec3 &n, float distance, const CollisionParams &params)
+{
+    if (distance < params.radius) {
+        float push = params.radius - distance;
+        p.pos_x[i] += n.x * push;
+        p.pos_y[i] += n.y * push;
+        p.pos_z[i] += n.z * push;
+    }
+
+    glm::vec3 velocity(p.vel_x[i], p.vel_y[i], p.vel_z[i]);
+    float into = glm::dot(velocity, n);
+    if (into < 0.0f) {
+        glm::vec3 normal_part = n * into;
+        glm::vec3 tangent_part = velocity - normal_part;
+        velocity = tangent_part * (1.0f - params.friction) - normal_part * params.restitution;
+        p.vel_x[i] = velocity.x;
+        p.vel_y[i] = velocity.y;
+        p.vel_z[i] = velocity.z;
+    }
+}
+
+void boxBoundary(const glm::vec3 &low, const glm::vec3 &high, CollisionPlane planes[6])
+{
+    for (int axis = 0; axis < 3; axis++) {
+        glm::vec3 n(0.0f);
+        n[axis] = 1.0f;
+        planes[2 * axis].normal = n;
+        planes[2 * axis].offset = low[axis];
+        planes[2 * axis + 1].normal = -n;
+        planes[2 * axis + 1].offset = -high[axis];
+    }
+}
+
+int collideDistanceField(ParticleStore &p, int begin, int end, const DistanceField &field,
+                         const CollisionParams &params, float dt)
+{
+    int contacts = 0;
+    for (int i = begin; i < end; i++) {
+        glm::vec3 position(p.pos_x[i], p.pos_y[i], p.pos_z[i]);
+        glm::vec3 velocity(p.vel_x[i], p.vel_y[i], p.vel_z[i]);
+
+        // most particles are nowhere near the surface and stop here
+        float distance = field.sample(position);
+        float ahead = field.sample(position + velocity * dt);
+        if (distance >= params.radius && ahead >= params.radius)
+            continue;
+
+        glm::vec3 n = field.normal(distance < ahead ? position : position + velocity * dt);
+        respond(p, i, n, distance, params);
+        contacts++;
+    }
+    return contacts;
+}
+
+int collidePlanes(ParticleStore &p, int begin, int end, const CollisionPlane *planes, int plane_count,
+                  const CollisionParams &params, float dt)
+{
+    int contacts = 0;
+    for (int k = 0; k < plane_count; k++) {
+        const glm::vec3 n = planes[k].normal;
+        for (int i = begin; i < end; i++) {
+            float distance = n.x * p.pos_x[i] + n.y * p.pos_y[i] + n.z * p.pos_z[i] - planes[k].offset;
+            float closing = n.x * p.vel_x[i] + n.y * p.vel_y[i] + n.z * p.vel_z[i];
+            if (distance >= params.radius && distance + closing * dt >= params.radius)
+                continue;
+            respond(p, i, n, distance, params);
+            contacts++;
+        }
+    }
+    return contacts;
+}
+
+int collideParallel(ThreadPool &pool, ParticleStore &particles, const CollisionPlane *planes, int plane_count,
+                    const DistanceField *field, const CollisionParams &params, float dt)
+{
+    const int first = particles.sleep_count;
+    const int count = particles.alive_count - first;
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+
+    std::vector<int> contacts(chunks);
+    pool.run(chunks, [&](int c) {
+        int begin = first + c * chunk;
+        int end = std::min(first + count, begin + chunk);
+        contacts[c] = collidePlanes(particles, begin, end, planes, plane_count, params, dt);
+        if (field != NULL)
+            contacts[c] += collideDistanceField(particles, begin, end, *field, params, dt);
+    });
+
+    int total = 0;
+    for (int c = 0; c < chunks; c++)
+        total += contacts[c];
+    return total;
+}
@@ -0,0 +1,41 @@
+#ifndef PARTICLE_COLLISION_H
+#define PARTICLE_COLLISION_H
+
+#include <glm/glm.hpp>
+
+#include "distance_field.h"
+#include "particle_store.h"
+#include "thread_pool.h"
+
+struct CollisionParams {
+    float radius;       // particles keep at least this far from the surface
+    float restitution;  // share of the normal speed kept after a bounce
+    float friction;     // share of the tangential speed lost per contact
+};
+
+// the half space dot(normal, p) >= offset is open, the rest is solid
+struct CollisionPlane {
+    glm::vec3 normal;   // unit length
+    float offset;
+};
+
+// the six inward facing planes that keep particles inside [low, high]
+void boxBoundary(const glm::vec3 &low, const glm::vec3 &high, CollisionPlane planes[6]);
+
+// Both colliders treat particles [begin, end) the same way. A particle that is
+// inside the surface, or would be after dt at its current velocity, has its
+// velocity reflected about the surface normal, scaled by restitution along the
+// normal and by 1 - friction along the surface. If it is already inside, it is
+// also moved back out onto the surface.
+// Each returns the number of particles that touched the surface.
+int collideDistanceField(ParticleStore &particles, int begin, int end, const DistanceField &field,
+                         const CollisionParams &params, float dt);
+int collidePlanes(ParticleStore &particles, int begin, int end, const CollisionPlane *planes, int plane_count,
+                  const CollisionParams &params, float dt);
+
+// every plane, then the field if there is one, over the awake particles,
+// split across the pool
+int collideParallel(ThreadPool &pool, ParticleStore &particles, const CollisionPlane *planes, int plane_count,
+                    const DistanceField *field, const CollisionParams &params, float dt);
+
+#endif
@@ -0,0 +1,169 @@
+#include "particle_kernels.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "particle_kernels_variants.h"
+
+unsigned int integrateFeatures(const StepParams &params, const float *out)
+{
+    unsigned int features = 0;
+    if (params.gravity_x != 0.0f || params.gravity_y != 0.0f || params.gravity_z != 0.0f)
+        features |= INTEGRATE_GRAVITY;
+    if (params.drag != 0.0f)
+        features |= INTEGRATE_DRAG;
+    if (out != NULL)
+        features |= INTEGRATE_OUTPUT;
+    return features;
+}
+
+IntegrateResult IntegrateKernel::run(ParticleStore &particles, int begin, int end,
+                                     const StepParams &params, float *out, int *dead) const
+{
+    return variants[integrateFeatures(params, out)](particles, begin, end, params, out, dead);
+}
+
+void integrateScalarVariants(IntegrateFunc *variants)
+{
+    FILL_INTEGRATE_VARIANTS(variants, integrateScalarVariant);
+}
+
+int writePositions(const ParticleStore &p, int begin, int end, float lag, float *out)
+{
+    for (int i = begin; i < end; i++) {
+        float *dst = out + 3 * (i - begin);
+        dst[0] = p.pos_x[i] - p.vel_x[i] * lag;
+        dst[1] = p.pos_y[i] - p.vel_y[i] * lag;
+        dst[2] = p.pos_z[i] - p.vel_z[i] * lag;
+    }
+    return end - begin;
+}
+
+int countSurvivors(const ParticleStore &p, int begin, int end, float dt)
+{
+    int count = 0;
+    for (int i = begin; i < end; i++)
+        count += (p.life[i] - dt > 0.0f) ? 1 : 0;
+    return count;
+}
+
+struct KernelEntry {
+    IntegrateKernel kernel;
+    bool supported;
+};
+
+static KernelEntry kernelEntry(const char *name, void (*fill)(IntegrateFunc *), bool supported)
+{
+    KernelEntry entry;
+    entry.kernel.name = name;
+    fill(entry.kernel.variants);
+    entry.supported = supported;
+    return entry;
+}
+
+static std::vector<KernelEntry> kernelTable() {
+    std::vector<KernelEntry> table;
+    table.push_back(kernelEntry("scalar", integrateScalarVariants, true));
+#ifdef PARTICLE_KERNELS_X86
+    __builtin_cpu_init();
+    table.push_back(kernelEntry("sse2", integrateSSE2Variants, __builtin_cpu_supports("sse2") != 0));
+    table.push_back(kernelEntry("avx2", integrateAVX2Variants, __builtin_cpu_supports("avx2") != 0));
+    table.push_back(kernelEntry("avx512", integrateAVX512Variants, __builtin_cpu_supports("avx512f") != 0));
+#endif
+    return table;
+}
+
+IntegrateKernel selectIntegrateKernel()
+{
+    std::vector<KernelEntry> table = kernelTable();
+    const char *forced = getenv("PARTICLE_KERNEL");
+
+    IntegrateKernel best = table[0].kernel;
+    for (size_t i = 0; i < table.size(); i++) {
+        if (!table[i].supported)
+            continue;
+        if (forced != NULL && std::strcmp(forced, table[i].kernel.name) == 0)
+            return table[i].kernel;
+        best = table[i].kernel;
+    }
+    if (forced != NULL)
+        std::cout << "ERROR::PARTICLE_KERNELS::UNSUPPORTED_KERNEL " << forced << ", using " << best.name << std::endl;
+    return best;
+}
+
+// fills a store with particles whose life ends inside the next step at random,
+// so both the full-vector and the partial-vector paths are exercised
+static void fillVerifyStore(ParticleStore &p, int count) {
+    unsigned int state = 12345u;
+    for (int i = 0; i < count; i++) {
+        float values[7];
+        for (int k = 0; k < 7; k++) {
+            state = state * 1664525u + 1013904223u;
+            values[k] = (float)(state >> 8) / (float)(1 << 24) * 2.0f - 1.0f;
+        }
+        int slot = p.spawn();
+        p.pos_x[slot] = values[0] * 10.0f;
+        p.pos_y[slot] = values[1] * 10.0f;
+        p.pos_z[slot] = values[2] * 10.0f;
+        p.vel_x[slot] = values[3] * 5.0f;
+        p.vel_y[slot] = values[4] * 5.0f;
+        p.vel_z[slot] = values[5] * 5.0f;
+        p.life[slot] = values[6] < -0.8f ? 0.01f : 1.0f + values[6];
+    }
+}
+
+bool verifyIntegrateKernels()
+{
+    // not a multiple of any vector width, and begins off alignment
+    const int count = 4099;
+    const int begin = 3;
+
+    bool ok = true;
+    std::vector<KernelEntry> table = kernelTable();
+    for (unsigned int features = 0; features < INTEGRATE_VARIANTS; features++) {
+        StepParams params = {0.016f, 0.0f, 0.0f, 0.0f, 0.0f, 0.004f};
+        if (features & INTEGRATE_GRAVITY)
+            params.gravity_y = -9.81f;
+        if (features & INTEGRATE_DRAG)
+            params.drag = 0.5f;
+        const bool output = (features & INTEGRATE_OUTPUT) != 0;
+
+        ParticleStore reference(count);
+        fillVerifyStore(reference, count);
+        std::vector<float> reference_out(3 * count);
+        std::vector<int> reference_dead(count);
+        IntegrateResult expected = table[0].kernel.run(reference, begin, count, params,
+                                                       output ? &reference_out[0] : NULL, &reference_dead[0]);
+
+        for (size_t k = 1; k < table.size(); k++) {
+            if (!table[k].supported)
+                continue;
+
+            ParticleStore particles(count);
+            fillVerifyStore(particles, count);
+            std::vector<float> out(3 * count);
+            std::vector<int> dead(count);
+            IntegrateResult result = table[k].kernel.run(particles, begin, count, params,
+                                                         output ? &out[0] : NULL, &dead[0]);
+
+            bool same = result.written == expected.written && result.dead == expected.dead
+                && std::memcmp(&out[0], &reference_out[0], sizeof(float) * 3 * result.written) == 0
+                && std::memcmp(&dead[0], &reference_dead[0], sizeof(int) * result.dead) == 0;
+            const float *arrays[7] = {particles.pos_x, particles.pos_y, particles.pos_z,
+                                      particles.vel_x, particles.vel_y, particles.vel_z, particles.life};
+            const float *reference_arrays[7] = {reference.pos_x, reference.pos_y, reference.pos_z,
+                                                reference.vel_x, reference.vel_y, reference.vel_z, reference.life};
+            for (int a = 0; a < 7; a++)
+                same = same && std::memcmp(arrays[a], reference_arrays[a], sizeof(float) * count) == 0;
+
+            if (!same) {
+                std::cout << "ERROR::PARTICLE_KERNELS::MISMATCH " << table[k].kernel.name << " features " << features
+                          << " disagrees with scalar" << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,83 @@
+#ifndef PARTICLE_KERNELS_H
+#define PARTICLE_KERNELS_H
+
+#include "particle_store.h"
+
+// constants for one simulation step
+struct StepParams {
+    float dt;
+    float gravity_x, gravity_y, gravity_z;
+    // fraction of its velocity a particle loses per second to the air: every
+    // step scales the velocity by 1 - drag * dt before gravity acts
+    float drag;
+    // how far the rendered positions trail the new state, in seconds. the
+    // output is pos - vel * output_lag, which interpolates between the previous
+    // and the new position; 0 outputs the new position.
+    float output_lag;
+};
+
+struct IntegrateResult {
+    int written; // positions written to the output buffer
+    int dead;    // slots appended to the dead list
+};
+
+// Advances slots [begin, end) of the store by one step.
+// Every particle loses dt of life and is integrated; the ones still alive get
+// their position appended to out as packed xyz, in slot order, and the ones
+// that died are appended to dead in ascending order for the caller to remove.
+// out may be NULL when no positions are needed; the count is still returned.
+// All variants produce bit-identical results.
+typedef IntegrateResult (*IntegrateFunc)(ParticleStore &particles, int begin, int end,
+                                         const StepParams &params, float *out, int *dead);
+
+// What a step does beyond ageing and moving the particles. Every kernel is a
+// template on a mask of these, instantiated once per mask, so the loop of a
+// step carries no test or arithmetic for the features it does not use. A new
+// feature is a new bit, and costs nothing to the steps that leave it off.
+enum IntegrateFeature {
+    INTEGRATE_GRAVITY = 1,   // gravity is not zero
+    INTEGRATE_DRAG = 2,      // drag is not zero
+    INTEGRATE_OUTPUT = 4     // positions are written to out
+};
+const int INTEGRATE_VARIANTS = 8;
+
+// the features a step with these params and this output buffer needs
+unsigned int integrateFeatures(const StepParams &params, const float *out);
+
+struct IntegrateKernel {
+    const char *name;
+    // the instantiation for every feature mask
+    IntegrateFunc variants[INTEGRATE_VARIANTS];
+
+    // runs the instantiation with just the features params and out need
+    IntegrateResult run(ParticleStore &particles, int begin, int end,
+                        const StepParams &params, float *out, int *dead) const;
+};
+
+// fill variants with the instantiations of one instruction set. scalar is the
+// reference implementation, also the fallback on non-x86 targets
+void integrateScalarVariants(IntegrateFunc *variants);
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define PARTICLE_KERNELS_X86 1
+void integrateSSE2Variants(IntegrateFunc *variants);
+void integrateAVX2Variants(IntegrateFunc *variants);
+void integrateAVX512Variants(IntegrateFunc *variants);
+#endif
+
+// writes pos - vel * lag of slots [begin, end) to out without stepping, for
+// frames that render between two simulation steps. returns the count written.
+int writePositions(const ParticleStore &particles, int begin, int end, float lag, float *out);
+
+// number of particles in [begin, end) an integration step with this dt keeps
+// alive. makes exactly the same decision as the kernels.
+int countSurvivors(const ParticleStore &particles, int begin, int end, float dt);
+
+// the widest kernel this CPU supports. The PARTICLE_KERNEL environment variable
+// (scalar, sse2, avx2, avx512) forces a narrower one.
+IntegrateKernel selectIntegrateKernel();
+
+// runs every variant of every kernel the CPU supports against the scalar one
+// on the same input and reports any difference. returns true when they all agree.
+bool verifyIntegrateKernels();
+
+#endif
@@ -0,0 +1,82 @@
+#include "particle_kernels.h"
+
+#ifdef PARTICLE_KERNELS_X86
+#include <immintrin.h>
+
+#include "particle_kernels_variants.h"
+#include "particle_kernels_x86.h"
+
+template <unsigned int FEATURES>
+static IntegrateResult integrateAVX2Variant(ParticleStore &p, int begin, int end,
+                                            const StepParams &params, float *out, int *dead)
+{
+    const float dt = params.dt;
+    const __m256 dt8 = _mm256_set1_ps(dt);
+    const __m256 step_x = _mm256_set1_ps(params.gravity_x * dt * 0.5f);
+    const __m256 step_y = _mm256_set1_ps(params.gravity_y * dt * 0.5f);
+    const __m256 step_z = _mm256_set1_ps(params.gravity_z * dt * 0.5f);
+    const __m256 keep = _mm256_set1_ps(1.0f - params.drag * dt);
+    const __m256 lag = _mm256_set1_ps(params.output_lag);
+    const __m256 zero = _mm256_setzero_ps();
+
+    IntegrateResult result = {0, 0};
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 life = _mm256_sub_ps(_mm256_loadu_ps(p.life + i), dt8);
+        __m256 vx = _mm256_loadu_ps(p.vel_x + i);
+        __m256 vy = _mm256_loadu_ps(p.vel_y + i);
+        __m256 vz = _mm256_loadu_ps(p.vel_z + i);
+        if (FEATURES & INTEGRATE_DRAG) {
+            vx = _mm256_mul_ps(vx, keep);
+            vy = _mm256_mul_ps(vy, keep);
+            vz = _mm256_mul_ps(vz, keep);
+        }
+        if (FEATURES & INTEGRATE_GRAVITY) {
+            vx = _mm256_add_ps(vx, step_x);
+            vy = _mm256_add_ps(vy, step_y);
+            vz = _mm256_add_ps(vz, step_z);
+        }
+        __m256 px = _mm256_add_ps(_mm256_loadu_ps(p.pos_x + i), _mm256_mul_ps(vx, dt8));
+        __m256 py = _mm256_add_ps(_mm256_loadu_ps(p.pos_y + i), _mm256_mul_ps(vy, dt8));
+        __m256 pz = _mm256_add_ps(_mm256_loadu_ps(p.pos_z + i), _mm256_mul_ps(vz, dt8));
+        _mm256_storeu_ps(p.life + i, life);
+        // without drag or gravity the velocity is only read
+        if (FEATURES & (INTEGRATE_GRAVITY | INTEGRATE_DRAG)) {
+            _mm256_storeu_ps(p.vel_x + i, vx);
+            _mm256_storeu_ps(p.vel_y + i, vy);
+            _mm256_storeu_ps(p.vel_z + i, vz);
+        }
+        _mm256_storeu_ps(p.pos_x + i, px);
+        _mm256_storeu_ps(p.pos_y + i, py);
+        _mm256_storeu_ps(p.pos_z + i, pz);
+
+        unsigned int alive_mask = _mm256_movemask_ps(_mm256_cmp_ps(life, zero, _CMP_GT_OQ));
+        if (alive_mask == 0xFF) {
+            if (FEATURES & INTEGRATE_OUTPUT) {
+                __m256 ox = _mm256_sub_ps(px, _mm256_mul_ps(vx, lag));
+                __m256 oy = _mm256_sub_ps(py, _mm256_mul_ps(vy, lag));
+                __m256 oz = _mm256_sub_ps(pz, _mm256_mul_ps(vz, lag));
+                float *dst = out + 3 * result.written;
+                storeTriplets(dst, _mm256_castps256_ps128(ox), _mm256_castps256_ps128(oy), _mm256_castps256_ps128(oz));
+                storeTriplets(dst + 12, _mm256_extractf128_ps(ox, 1), _mm256_extractf128_ps(oy, 1), _mm256_extractf128_ps(oz, 1));
+            }
+            result.written += 8;
+        } else {
+            emitPartial(p, i, 8, alive_mask, params.output_lag, (FEATURES & INTEGRATE_OUTPUT) ? out : NULL, dead,
+                        result);
+        }
+    }
+
+    float *tail_out = (FEATURES & INTEGRATE_OUTPUT) ? out + 3 * result.written : NULL;
+    IntegrateResult tail = integrateScalarVariant<FEATURES>(p, i, end, params, tail_out, dead + result.dead);
+    result.written += tail.written;
+    result.dead += tail.dead;
+    return result;
+}
+
+void integrateAVX2Variants(IntegrateFunc *variants)
+{
+    FILL_INTEGRATE_VARIANTS(variants, integrateAVX2Variant);
+}
+
+#endif
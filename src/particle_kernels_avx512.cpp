@@ -0,0 +1,93 @@
+#include "particle_kernels.h"
+
+#ifdef PARTICLE_KERNELS_X86
+#include <immintrin.h>
+
+#include "particle_kernels_variants.h"
+#include "particle_kernels_x86.h"
+
+static inline __m256 upperHalf(__m512 v)
+{
+    return _mm512_castps512_ps256(_mm512_shuffle_f32x4(v, v, _MM_SHUFFLE(3, 2, 3, 2)));
+}
+
+static inline void storeTriplets8(float *out, __m256 x, __m256 y, __m256 z)
+{
+    storeTriplets(out, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z));
+    storeTriplets(out + 12, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1));
+}
+
+template <unsigned int FEATURES>
+static IntegrateResult integrateAVX512Variant(ParticleStore &p, int begin, int end,
+                                              const StepParams &params, float *out, int *dead)
+{
+    const float dt = params.dt;
+    const __m512 dt16 = _mm512_set1_ps(dt);
+    const __m512 step_x = _mm512_set1_ps(params.gravity_x * dt * 0.5f);
+    const __m512 step_y = _mm512_set1_ps(params.gravity_y * dt * 0.5f);
+    const __m512 step_z = _mm512_set1_ps(params.gravity_z * dt * 0.5f);
+    const __m512 keep = _mm512_set1_ps(1.0f - params.drag * dt);
+    const __m512 lag = _mm512_set1_ps(params.output_lag);
+    const __m512 zero = _mm512_setzero_ps();
+
+    IntegrateResult result = {0, 0};
+    int i = begin;
+    for (; i + 16 <= end; i += 16) {
+        __m512 life = _mm512_sub_ps(_mm512_loadu_ps(p.life + i), dt16);
+        __m512 vx = _mm512_loadu_ps(p.vel_x + i);
+        __m512 vy = _mm512_loadu_ps(p.vel_y + i);
+        __m512 vz = _mm512_loadu_ps(p.vel_z + i);
+        if (FEATURES & INTEGRATE_DRAG) {
+            vx = _mm512_mul_ps(vx, keep);
+            vy = _mm512_mul_ps(vy, keep);
+            vz = _mm512_mul_ps(vz, keep);
+        }
+        if (FEATURES & INTEGRATE_GRAVITY) {
+            vx = _mm512_add_ps(vx, step_x);
+            vy = _mm512_add_ps(vy, step_y);
+            vz = _mm512_add_ps(vz, step_z);
+        }
+        __m512 px = _mm512_add_ps(_mm512_loadu_ps(p.pos_x + i), _mm512_mul_ps(vx, dt16));
+        __m512 py = _mm512_add_ps(_mm512_loadu_ps(p.pos_y + i), _mm512_mul_ps(vy, dt16));
+        __m512 pz = _mm512_add_ps(_mm512_loadu_ps(p.pos_z + i), _mm512_mul_ps(vz, dt16));
+        _mm512_storeu_ps(p.life + i, life);
+        // without drag or gravity the velocity is only read
+        if (FEATURES & (INTEGRATE_GRAVITY | INTEGRATE_DRAG)) {
+            _mm512_storeu_ps(p.vel_x + i, vx);
+            _mm512_storeu_ps(p.vel_y + i, vy);
+            _mm512_storeu_ps(p.vel_z + i, vz);
+        }
+        _mm512_storeu_ps(p.pos_x + i, px);
+        _mm512_storeu_ps(p.pos_y + i, py);
+        _mm512_storeu_ps(p.pos_z + i, pz);
+
+        unsigned int alive_mask = _mm512_cmp_ps_mask(life, zero, _CMP_GT_OQ);
+        if (alive_mask == 0xFFFF) {
+            if (FEATURES & INTEGRATE_OUTPUT) {
+                __m512 ox = _mm512_sub_ps(px, _mm512_mul_ps(vx, lag));
+                __m512 oy = _mm512_sub_ps(py, _mm512_mul_ps(vy, lag));
+                __m512 oz = _mm512_sub_ps(pz, _mm512_mul_ps(vz, lag));
+                float *dst = out + 3 * result.written;
+                storeTriplets8(dst, _mm512_castps512_ps256(ox), _mm512_castps512_ps256(oy), _mm512_castps512_ps256(oz));
+                storeTriplets8(dst + 24, upperHalf(ox), upperHalf(oy), upperHalf(oz));
+            }
+            result.written += 16;
+        } else {
+            emitPartial(p, i, 16, alive_mask, params.output_lag, (FEATURES & INTEGRATE_OUTPUT) ? out : NULL, dead,
+                        result);
+        }
+    }
+
+    float *tail_out = (FEATURES & INTEGRATE_OUTPUT) ? out + 3 * result.written : NULL;
+    IntegrateResult tail = integrateScalarVariant<FEATURES>(p, i, end, params, tail_out, dead + result.dead);
+    result.written += tail.written;
+    result.dead += tail.dead;
+    return result;
+}
+
+void integrateAVX512Variants(IntegrateFunc *variants)
+{
+    FILL_INTEGRATE_VARIANTS(variants, integrateAVX512Variant);
+}
+
+#endif
@@ -0,0 +1,76 @@
+#include "particle_kernels.h"
+
+#ifdef PARTICLE_KERNELS_X86
+#include "particle_kernels_variants.h"
+#include "particle_kernels_x86.h"
+
+template <unsigned int FEATURES>
+static IntegrateResult integrateSSE2Variant(ParticleStore &p, int begin, int end,
+                                            const StepParams &params, float *out, int *dead)
+{
+    const float dt = params.dt;
+    const __m128 dt4 = _mm_set1_ps(dt);
+    const __m128 step_x = _mm_set1_ps(params.gravity_x * dt * 0.5f);
+    const __m128 step_y = _mm_set1_ps(params.gravity_y * dt * 0.5f);
+    const __m128 step_z = _mm_set1_ps(params.gravity_z * dt * 0.5f);
+    const __m128 keep = _mm_set1_ps(1.0f - params.drag * dt);
+    const __m128 lag = _mm_set1_ps(params.output_lag);
+    const __m128 zero = _mm_setzero_ps();
+
+    IntegrateResult result = {0, 0};
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 life = _mm_sub_ps(_mm_loadu_ps(p.life + i), dt4);
+        __m128 vx = _mm_loadu_ps(p.vel_x + i);
+        __m128 vy = _mm_loadu_ps(p.vel_y + i);
+        __m128 vz = _mm_loadu_ps(p.vel_z + i);
+        if (FEATURES & INTEGRATE_DRAG) {
+            vx = _mm_mul_ps(vx, keep);
+            vy = _mm_mul_ps(vy, keep);
+            vz = _mm_mul_ps(vz, keep);
+        }
+        if (FEATURES & INTEGRATE_GRAVITY) {
+            vx = _mm_add_ps(vx, step_x);
+            vy = _mm_add_ps(vy, step_y);
+            vz = _mm_add_ps(vz, step_z);
+        }
+        __m128 px = _mm_add_ps(_mm_loadu_ps(p.pos_x + i), _mm_mul_ps(vx, dt4));
+        __m128 py = _mm_add_ps(_mm_loadu_ps(p.pos_y + i), _mm_mul_ps(vy, dt4));
+        __m128 pz = _mm_add_ps(_mm_loadu_ps(p.pos_z + i), _mm_mul_ps(vz, dt4));
+        _mm_storeu_ps(p.life + i, life);
+        // without drag or gravity the velocity is only read
+        if (FEATURES & (INTEGRATE_GRAVITY | INTEGRATE_DRAG)) {
+            _mm_storeu_ps(p.vel_x + i, vx);
+            _mm_storeu_ps(p.vel_y + i, vy);
+            _mm_storeu_ps(p.vel_z + i, vz);
+        }
+        _mm_storeu_ps(p.pos_x + i, px);
+        _mm_storeu_ps(p.pos_y + i, py);
+        _mm_storeu_ps(p.pos_z + i, pz);
+
+        unsigned int alive_mask = _mm_movemask_ps(_mm_cmpgt_ps(life, zero));
+        if (alive_mask == 0xF) {
+            if (FEATURES & INTEGRATE_OUTPUT) {
+                storeTriplets(out + 3 * result.written, _mm_sub_ps(px, _mm_mul_ps(vx, lag)),
+                              _mm_sub_ps(py, _mm_mul_ps(vy, lag)), _mm_sub_ps(pz, _mm_mul_ps(vz, lag)));
+            }
+            result.written += 4;
+        } else {
+            emitPartial(p, i, 4, alive_mask, params.output_lag, (FEATURES & INTEGRATE_OUTPUT) ? out : NULL, dead,
+                        result);
+        }
+    }
+
+    float *tail_out = (FEATURES & INTEGRATE_OUTPUT) ? out + 3 * result.written : NULL;
+    IntegrateResult tail = integrateScalarVariant<FEATURES>(p, i, end, params, tail_out, dead + result.dead);
+    result.written += tail.written;
+    result.dead += tail.dead;
+    return result;
+}
+
+void integrateSSE2Variants(IntegrateFunc *variants)
+{
+    FILL_INTEGRATE_VARIANTS(variants, integrateSSE2Variant);
+}
+
+#endif
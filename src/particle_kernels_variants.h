@@ -0,0 +1,65 @@
+#ifndef PARTICLE_KERNELS_VARIANTS_H
+#define PARTICLE_KERNELS_VARIANTS_H
+
+// the scalar kernel template, shared by all the kernels for their tails; only
+// included by them. static, so every kernel file keeps its own copy compiled
+// with its own instruction set
+#include "particle_kernels.h"
+
+template <unsigned int FEATURES>
+static IntegrateResult integrateScalarVariant(ParticleStore &p, int begin, int end,
+                                              const StepParams &params, float *out, int *dead)
+{
+    const float dt = params.dt;
+    const float step_x = params.gravity_x * dt * 0.5f;
+    const float step_y = params.gravity_y * dt * 0.5f;
+    const float step_z = params.gravity_z * dt * 0.5f;
+    const float keep = 1.0f - params.drag * dt;
+    const float lag = params.output_lag;
+
+    IntegrateResult result = {0, 0};
+    for (int i = begin; i < end; i++) {
+        p.life[i] -= dt;
+        if (FEATURES & INTEGRATE_DRAG) {
+            p.vel_x[i] *= keep;
+            p.vel_y[i] *= keep;
+            p.vel_z[i] *= keep;
+        }
+        if (FEATURES & INTEGRATE_GRAVITY) {
+            p.vel_x[i] += step_x;
+            p.vel_y[i] += step_y;
+            p.vel_z[i] += step_z;
+        }
+        p.pos_x[i] += p.vel_x[i] * dt;
+        p.pos_y[i] += p.vel_y[i] * dt;
+        p.pos_z[i] += p.vel_z[i] * dt;
+
+        if (p.life[i] > 0.0f) {
+            if (FEATURES & INTEGRATE_OUTPUT) {
+                float *dst = out + 3 * result.written;
+                dst[0] = p.pos_x[i] - p.vel_x[i] * lag;
+                dst[1] = p.pos_y[i] - p.vel_y[i] * lag;
+                dst[2] = p.pos_z[i] - p.vel_z[i] * lag;
+            }
+            result.written++;
+        } else {
+            dead[result.dead++] = i;
+        }
+    }
+    return result;
+}
+
+// variants[mask] = kernel<mask> for every feature mask
+#define FILL_INTEGRATE_VARIANTS(variants, kernel) \
+    do { \
+        (variants)[0] = kernel<0>; \
+        (variants)[1] = kernel<1>; \
+        (variants)[2] = kernel<2>; \
+        (variants)[3] = kernel<3>; \
+        (variants)[4] = kernel<4>; \
+        (variants)[5] = kernel<5>; \
+        (variants)[6] = kernel<6>; \
+        (variants)[7] = kernel<7>; \
+    } while (0)
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PARTICLE_KERNELS_X86_H
+#define PARTICLE_KERNELS_X86_H
+
+// helpers shared by the x86 integration kernels; only included by them
+#include <emmintrin.h>
+
+#include "particle_kernels.h"
+
+// writes four particles given as x, y and z lanes as packed xyz triplets
+static inline void storeTriplets(float *out, __m128 x, __m128 y, __m128 z)
+{
+    __m128 xy_lo = _mm_unpacklo_ps(x, y);                               // x0 y0 x1 y1
+    __m128 xy_hi = _mm_unpackhi_ps(x, y);                               // x2 y2 x3 y3
+    __m128 lo = _mm_shuffle_ps(z, xy_lo, _MM_SHUFFLE(3, 2, 1, 0));      // z0 z1 x1 y1
+    __m128 hi = _mm_shuffle_ps(z, xy_hi, _MM_SHUFFLE(3, 2, 3, 2));      // z2 z3 x3 y3
+    _mm_storeu_ps(out + 0, _mm_shuffle_ps(xy_lo, lo, _MM_SHUFFLE(2, 0, 1, 0))); // x0 y0 z0 x1
+    _mm_storeu_ps(out + 4, _mm_shuffle_ps(lo, xy_hi, _MM_SHUFFLE(1, 0, 1, 3))); // y1 z1 x2 y2
+    _mm_storeu_ps(out + 8, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 3, 2, 0)));    // z2 x3 y3 z3
+}
+
+// compacts a vector of `width` particles starting at slot i when some of them
+// died: survivors go to out, the dead to the dead list
+static inline void emitPartial(const ParticleStore &p, int i, int width, unsigned int alive_mask,
+                               float lag, float *out, int *dead, IntegrateResult &result)
+{
+    for (int j = 0; j < width; j++) {
+        if (alive_mask & (1u << j)) {
+            if (out != NULL) {
+                float *dst = out + 3 * result.written;
+                dst[0] = p.pos_x[i + j] - p.vel_x[i + j] * lag;
+                dst[1] = p.pos_y[i + j] - p.vel_y[i + j] * lag;
+                dst[2] = p.pos_z[i + j] - p.vel_z[i + j] * lag;
+            }
+            result.written++;
+        } else {
+            dead[result.dead++] = i + j;
+        }
+    }
+}
+
+#endif
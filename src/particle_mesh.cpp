@@ -0,0 +1,381 @@
+#include "particle_mesh.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "particle_update.h"
+#include "random.h"
+
+// lines gathered together by a transform task, so the strided passes read
+// whole cache lines
+static const int LINE_TILE = 16;
+
+// planes in a deposit slab. fixed rather than fit to the pool, so a cell on a
+// slab boundary always sums its bodies in the same order whatever the thread
+// count, and runs stay reproducible
+static const int DEPOSIT_SLAB = 4;
+
+// in-place radix-2 transform of n interleaved complex values
+static void transformLine(float *a, int n, const int *bit_reverse, const float *twiddle, bool inverse)
+{
+    for (int i = 0; i < n; i++) {
+        int j = bit_reverse[i];
+        if (i < j) {
+            std::swap(a[2 * i], a[2 * j]);
+            std::swap(a[2 * i + 1], a[2 * j + 1]);
+        }
+    }
+    const float sign = inverse ? -1.0f : 1.0f;
+    for (int half = 1, step = n / 2; half < n; half *= 2, step /= 2) {
+        for (int i = 0; i < n; i += 2 * half) {
+            for (int k = 0; k < half; k++) {
+                float wr = twiddle[2 * k * step], wi = sign * twiddle[2 * k * step + 1];
+                float *u = a + 2 * (i + k), *v = a + 2 * (i + k + half);
+                float vr = v[0] * wr - v[1] * wi, vi = v[0] * wi + v[1] * wr;
+                v[0] = u[0] - vr;
+                v[1] = u[1] - vi;
+                u[0] += vr;
+                u[1] += vi;
+            }
+        }
+    }
+}
+
+ParticleMesh::ParticleMesh()
+    : size(64), spacing(1.0f), padded(0), green_size(0)
+{
+    origin[0] = origin[1] = origin[2] = 0.0f;
+}
+
+void ParticleMesh::prepare(ThreadPool &pool)
+{
+    if (green_size == size)
+        return;
+
+    padded = 2 * size;
+    const int n = padded;
+    int bits = 0;
+    while ((1 << bits) < n)
+        bits++;
+    bit_reverse.resize(n);
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        bit_reverse[i] = r;
+    }
+    twiddle.resize(n);
+    for (int k = 0; k < n / 2; k++) {
+        double angle = -2.0 * 3.14159265358979323846 * k / n;
+        twiddle[2 * k] = (float)std::cos(angle);
+        twiddle[2 * k + 1] = (float)std::sin(angle);
+    }
+
+    // potential of a unit mass, softened by a cell, at every separation the
+    // padded mesh wraps round to; the inverse transform's 1 / n^3 goes in too
+    const size_t points = (size_t)n * n * n;
+    spectrum.assign(2 * points, 0.0f);
+    density.resize((size_t)size * size * size);
+    for (int k = 0; k < 3; k++)
+        gradient[k].resize(density.size());
+    pool.run(n, [&](int z) {
+        int dz = std::min(z, n - z);
+        for (int y = 0; y < n; y++) {
+            int dy = std::min(y, n - y);
+            float *row = &spectrum[2 * ((size_t)z * n + y) * n];
+            for (int x = 0; x < n; x++) {
+                int dx = std::min(x, n - x);
+                row[2 * x] = -1.0f / std::sqrt((float)(dx * dx + dy * dy + dz * dz) + 1.0f);
+            }
+        }
+    });
+    transformLines(pool, 1, n, n * n, n, n, false);
+    transformLines(pool, n, n, n * n, n, 1, false);
+    transformLines(pool, n * n, n, n, n, 1, false);
+    // real, the potential being even
+    green.resize(points);
+    const float scale = 1.0f / (float)points;
+    for (size_t i = 0; i < points; i++)
+        green[i] = spectrum[2 * i] * scale;
+    green_size = size;
+}
+
+void ParticleMesh::transformLines(ThreadPool &pool, int stride, int outer_count, int outer_stride, int line_count,
+                                  int line_step, bool inverse)
+{
+    const int n = padded;
+    const int tiles = (line_count + LINE_TILE - 1) / LINE_TILE;
+    pool.run(outer_count * tiles, [&](int task) {
+        float scratch[2 * LINE_TILE * 512];
+        std::vector<float> heap;
+        float *lines = scratch;
+        if (n > 512) {
+            heap.resize(2 * (size_t)LINE_TILE * n);
+            lines = heap.data();
+        }
+        const int o = task / tiles, first = (task % tiles) * LINE_TILE;
+        const int count = std::min(LINE_TILE, line_count - first);
+        float *base = &spectrum[2 * ((size_t)o * outer_stride + (size_t)first * line_step)];
+        // point k of line t is at base + k * stride + t * line_step
+        for (int k = 0; k < n; k++) {
+            const float *point = base + 2 * (size_t)k * stride;
+            for (int t = 0; t < count; t++) {
+                lines[2 * (t * n + k)] = point[2 * (size_t)t * line_step];
+                lines[2 * (t * n + k) + 1] = point[2 * (size_t)t * line_step + 1];
+            }
+        }
+        for (int t = 0; t < count; t++)
+            transformLine(lines + 2 * (size_t)t * n, n, bit_reverse.data(), twiddle.data(), inverse);
+        for (int k = 0; k < n; k++) {
+            float *point = base + 2 * (size_t)k * stride;
+            for (int t = 0; t < count; t++) {
+                point[2 * (size_t)t * line_step] = lines[2 * (t * n + k)];
+                point[2 * (size_t)t * line_step + 1] = lines[2 * (t * n + k) + 1];
+            }
+        }
+    });
+}
+
+void ParticleMesh::transform(ThreadPool &pool, bool inverse)
+{
+    const int n = padded, m = size;
+    if (!inverse) {
+        // x lines of the corner, then y lines of its z planes, then every z line
+        transformLines(pool, 1, m, n * n, m, n, false);
+        transformLines(pool, n, m, n * n, n, 1, false);
+        transformLines(pool, n * n, n, n, n, 1, false);
+    } else {
+        transformLines(pool, n * n, n, n, n, 1, true);
+        transformLines(pool, n, m, n * n, n, 1, true);
+        transformLines(pool, 1, m, n * n, m, n, true);
+    }
+}
+
+void ParticleMesh::deposit(ThreadPool &pool, const ParticleStore &particles)
+{
+    const int count = particles.alive_count;
+    const int m = size;
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    int plane_bits = 0;
+    while ((1 << plane_bits) < m)
+        plane_bits++;
+
+    planes.resize(count);
+    order.resize(count);
+    pool.run(chunks, [&](int c) {
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            planes[i] = (unsigned int)((particles.pos_z[i] - origin[2]) / spacing);
+            order[i] = i;
+        }
+    });
+    radixSortPairs(pool, planes, order, plane_bits, sort_buffers);
+
+    std::fill(density.begin(), density.end(), 0.0f);
+    const int slab = DEPOSIT_SLAB;
+    const int slabs = (m - 1 + slab - 1) / slab;
+    for (int phase = 0; phase < 2; phase++) {
+        pool.run((slabs + 1 - phase) / 2, [&](int task) {
+            int s = 2 * task + phase;
+            int begin = (int)(std::lower_bound(planes.begin(), planes.end(), (unsigned int)(s * slab)) - planes.begin());
+            int end = (int)(std::lower_bound(planes.begin(), planes.end(), (unsigned int)((s + 1) * slab)) - planes.begin());
+            for (int i = begin; i < end; i++) {
+                int slot = order[i];
+                float u[3] = {(particles.pos_x[slot] - origin[0]) / spacing, (particles.pos_y[slot] - origin[1]) / spacing,
+                              (particles.pos_z[slot] - origin[2]) / spacing};
+                int cell[3];
+                float f[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    cell[axis] = (int)u[axis];
+                    f[axis] = u[axis] - (float)cell[axis];
+                }
+                float mass = particles.weight[slot];
+                for (int dz = 0; dz < 2; dz++) {
+                    float wz = mass * (dz ? f[2] : 1.0f - f[2]);
+                    for (int dy = 0; dy < 2; dy++) {
+                        float wzy = wz * (dy ? f[1] : 1.0f - f[1]);
+                        float *row = &density[((size_t)(cell[2] + dz) * m + cell[1] + dy) * m + cell[0]];
+                        row[0] += wzy * (1.0f - f[0]);
+                        row[1] += wzy * f[0];
+                    }
+                }
+            }
+        });
+    }
+}
+
+void ParticleMesh::solve(ThreadPool &pool, float constant)
+{
+    const int n = padded, m = size;
+    pool.run(n, [&](int z) {
+        for (int y = 0; y < n; y++) {
+            float *row = &spectrum[2 * ((size_t)z * n + y) * n];
+            if (z < m && y < m) {
+                const float *mass = &density[((size_t)z * m + y) * m];
+                for (int x = 0; x < m; x++) {
+                    row[2 * x] = mass[x];
+                    row[2 * x + 1] = 0.0f;
+                }
+                std::fill(row + 2 * m, row + 2 * n, 0.0f);
+            } else {
+                std::fill(row, row + 2 * n, 0.0f);
+            }
+        }
+    });
+    transform(pool, false);
+    pool.run(n, [&](int z) {
+        float *plane = &spectrum[2 * (size_t)z * n * n];
+        const float *g = &green[(size_t)z * n * n];
+        for (int i = 0; i < n * n; i++) {
+            plane[2 * i] *= g[i];
+            plane[2 * i + 1] *= g[i];
+        }
+    });
+    transform(pool, true);
+
+    // potential in the corner, then minus its gradient by central differences,
+    // one-sided at the faces
+    const float scale = constant / spacing;
+    pool.run(m, [&](int z) {
+        for (int y = 0; y < m; y++) {
+            const float *row = &spectrum[2 * ((size_t)z * n + y) * n];
+            float *potential = &density[((size_t)z * m + y) * m];
+            for (int x = 0; x < m; x++)
+                potential[x] = scale * row[2 * x];
+        }
+    });
+    const int steps[3] = {1, m, m * m};
+    pool.run(m, [&](int z) {
+        for (int y = 0; y < m; y++) {
+            for (int x = 0; x < m; x++) {
+                const int at[3] = {x, y, z};
+                size_t i = ((size_t)z * m + y) * m + x;
+                for (int axis = 0; axis < 3; axis++) {
+                    int low = at[axis] > 0 ? 1 : 0, high = at[axis] < m - 1 ? 1 : 0;
+                    float difference = density[i + high * steps[axis]] - density[i - low * steps[axis]];
+                    gradient[axis][i] = -difference / ((float)(low + high) * spacing);
+                }
+            }
+        }
+    });
+}
+
+void ParticleMesh::accelerations(ThreadPool &pool, const ParticleStore &particles, const GravityParams &params,
+                                 float *ax, float *ay, float *az)
+{
+    const int count = particles.alive_count;
+    if (count == 0)
+        return;
+    prepare(pool);
+
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    const float *pos[3] = {particles.pos_x, particles.pos_y, particles.pos_z};
+
+    // bounding cube of the bodies, half a cell in from the faces of the mesh
+    std::vector<float> chunk_bounds(6 * (size_t)chunks);
+    pool.run(chunks, [&](int c) {
+        float *b = &chunk_bounds[6 * (size_t)c];
+        int begin = c * chunk, end = std::min(count, begin + chunk);
+        for (int axis = 0; axis < 3; axis++) {
+            b[axis] = *std::min_element(pos[axis] + begin, pos[axis] + end);
+            b[3 + axis] = *std::max_element(pos[axis] + begin, pos[axis] + end);
+        }
+    });
+    float lo[3], side = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        float hi = chunk_bounds[3 + axis];
+        lo[axis] = chunk_bounds[axis];
+        for (int c = 1; c < chunks; c++) {
+            lo[axis] = std::min(lo[axis], chunk_bounds[6 * (size_t)c + axis]);
+            hi = std::max(hi, chunk_bounds[6 * (size_t)c + 3 + axis]);
+        }
+        side = std::max(side, hi - lo[axis]);
+    }
+    spacing = side > 0.0f ? side / (float)(size - 2) : 1.0f;
+    for (int axis = 0; axis < 3; axis++)
+        origin[axis] = lo[axis] - 0.5f * spacing;
+
+    deposit(pool, particles);
+    solve(pool, params.constant);
+
+    // back in the sorted order of the deposit, which walks the mesh plane by plane
+    const int m = size;
+    float *out[3] = {ax, ay, az};
+    pool.run(chunks, [&](int c) {
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            int slot = order[i];
+            int cell[3];
+            float f[3];
+            for (int axis = 0; axis < 3; axis++) {
+                float u = (pos[axis][slot] - origin[axis]) / spacing;
+                cell[axis] = (int)u;
+                f[axis] = u - (float)cell[axis];
+            }
+            size_t corner = ((size_t)cell[2] * m + cell[1]) * m + cell[0];
+            for (int axis = 0; axis < 3; axis++) {
+                const float *g = &gradient[axis][corner];
+                float sum = 0.0f;
+                for (int dz = 0; dz < 2; dz++) {
+                    float wz = dz ? f[2] : 1.0f - f[2];
+                    for (int dy = 0; dy < 2; dy++) {
+                        float wzy = wz * (dy ? f[1] : 1.0f - f[1]);
+                        const float *row = g + (size_t)dz * m * m + (size_t)dy * m;
+                        sum += wzy * ((1.0f - f[0]) * row[0] + f[0] * row[1]);
+                    }
+                }
+                out[axis][slot] = sum;
+            }
+        }
+    });
+}
+
+bool verifyParticleMesh()
+{
+    const int count = 8000;
+    ParticleStore particles(count);
+    Random random(0x93e5ull);
+    int first = 0;
+    particles.spawnBlock(count, &first);
+    // a uniform ball, smooth on the scale of the mesh
+    for (int i = 0; i < count; i++) {
+        float p[3], r2;
+        do {
+            for (int axis = 0; axis < 3; axis++)
+                p[axis] = random.symmetric();
+            r2 = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+        } while (r2 > 1.0f);
+        particles.pos_x[i] = 4.0f + p[0];
+        particles.pos_y[i] = p[1];
+        particles.pos_z[i] = -2.0f + p[2];
+        particles.weight[i] = 1.0f / count;
+    }
+
+    ThreadPool pool(2);
+    ParticleMesh mesh;
+    GravityParams params = {1.0f, 0.0f};
+    std::vector<float> ax(count), ay(count), az(count);
+    mesh.accelerations(pool, particles, params, ax.data(), ay.data(), az.data());
+
+    // the direct sum softened like the mesh, by a cell
+    const double soft2 = (double)mesh.spacing * mesh.spacing;
+    double error2 = 0.0, norm2 = 0.0;
+    for (int i = 0; i < count; i++) {
+        double exact[3] = {0.0, 0.0, 0.0};
+        for (int j = 0; j < count; j++) {
+            double d[3] = {(double)particles.pos_x[j] - particles.pos_x[i], (double)particles.pos_y[j] - particles.pos_y[i],
+                           (double)particles.pos_z[j] - particles.pos_z[i]};
+            double r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2] + soft2;
+            double s = particles.weight[j] / (r2 * std::sqrt(r2));
+            for (int axis = 0; axis < 3; axis++)
+                exact[axis] += s * d[axis];
+        }
+        const double got[3] = {ax[i], ay[i], az[i]};
+        for (int axis = 0; axis < 3; axis++) {
+            error2 += (got[axis] - exact[axis]) * (got[axis] - exact[axis]);
+            norm2 += exact[axis] * exact[axis];
+        }
+    }
+    // about 2% rms, most of it the graininess of 8000 bodies the mesh smooths over
+    return std::sqrt(error2 / norm2) < 0.05;
+}
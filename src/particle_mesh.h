@@ -0,0 +1,71 @@
+#ifndef PARTICLE_MESH_H
+#define PARTICLE_MESH_H
+
+#include <vector>
+
+#include "gravity.h"
+#include "particle_store.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
+
+// Particle-mesh gravity: the bodies' mass is spread cloud-in-cell over a mesh
+// of size^3 points spanning their bounding cube, the potential solved with
+// FFTs, and its gradient interpolated back with the same weights.
+// The mesh is zero padded to twice its size and convolved with the potential
+// of a point mass, so the solve is for isolated bodies, not a periodic box.
+// The point mass is softened by one mesh cell, which stands in for
+// GravityParams::softening: forces are only right on scales of a few cells,
+// the price of a cost that grows with the body count only through the
+// deposit and the interpolation.
+// Deposition sorts the bodies by mesh plane and gives each task a slab of
+// planes; a body also touches the next plane, so even slabs go first, then
+// odd ones, and no two tasks ever write the same point. The slabs do not
+// depend on the pool, so the sums do not either.
+class ParticleMesh
+{
+public:
+    // mesh points per axis, a power of two
+    int size;
+
+    // of the last solve: corner of the mesh and the spacing of its points
+    float origin[3];
+    float spacing;
+    // mass, then potential, at every mesh point, x fastest
+    std::vector<float> density;
+
+    ParticleMesh();
+
+    // acceleration of every live particle, sleepers included, written to ax,
+    // ay and az by slot
+    void accelerations(ThreadPool &pool, const ParticleStore &particles, const GravityParams &params,
+                       float *ax, float *ay, float *az);
+
+private:
+    int padded;                        // 2 * size, the FFT length per axis
+    std::vector<float> spectrum;       // padded^3 complex values, re and im interleaved
+    std::vector<float> green;          // transform of the softened 1 / r, padded^3 real values
+    int green_size;                    // size the green function was made for
+    std::vector<float> twiddle;        // exp(-2 pi i k / padded), k < padded / 2, interleaved
+    std::vector<int> bit_reverse;
+    std::vector<float> gradient[3];    // -d potential / d axis at every mesh point
+    std::vector<unsigned int> planes;  // of every body, for the deposit sort
+    std::vector<int> order;
+    RadixSortBuffers sort_buffers;
+
+    void prepare(ThreadPool &pool);
+    void deposit(ThreadPool &pool, const ParticleStore &particles);
+    // one direction of the 3D transform of spectrum. only the size^3 corner
+    // is non-zero going forward, and only it is wanted coming back, so lines
+    // outside it are skipped
+    void transform(ThreadPool &pool, bool inverse);
+    // transforms the lines of padded points stride apart that start at
+    // o * outer_stride + l * line_step, o < outer_count, l < line_count
+    void transformLines(ThreadPool &pool, int stride, int outer_count, int outer_stride, int line_count,
+                        int line_step, bool inverse);
+    void solve(ThreadPool &pool, float constant);
+};
+
+// forces on a smooth cluster must come close to a direct sum
+bool verifyParticleMesh();
+
+#endif
@@ -0,0 +1,321 @@
+#include "particle_store.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "particle_update.h"
+
+static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+static int paddedCount(int count) {
+    return (count + ParticleStore::PADDING - 1) / ParticleStore::PADDING * ParticleStore::PADDING;
+}
+
+// reserves address space for one array. pages are only backed once touched,
+// so a large max_capacity costs nothing until the pool grows into it
+static void *mapArray(size_t bytes, bool use_huge_pages, bool &huge) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    huge = false;
+#ifdef MAP_HUGETLB
+    if (use_huge_pages) {
+        // reserved up front: without the reservation a missing huge page would
+        // only show up as SIGBUS on first touch
+        void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            huge = true;
+            return ptr;
+        }
+    }
+#endif
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    // no reserved huge pages: ask for transparent ones instead
+    if (use_huge_pages)
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
+ParticleStore::ParticleStore(int capacity, int max_capacity, bool use_huge_pages)
+    : capacity(capacity), max_capacity(max_capacity > capacity ? max_capacity : capacity),
+      huge_pages(use_huge_pages), alive_count(0), sleep_count(0)
+{
+    float **list[ATTRIBUTE_COUNT] = {
+        &pos_x, &pos_y, &pos_z,
+        &vel_x, &vel_y, &vel_z,
+        &life,
+        &weight, &rest
+    };
+    std::memcpy(arrays, list, sizeof(list));
+    for (int k = 0; k < ATTRIBUTE_COUNT; k++)
+        *arrays[k] = NULL;
+    ids = NULL;
+    slot_of = NULL;
+    generation = NULL;
+
+    // whole huge pages per array, so every array starts on a huge page boundary
+    mapped_bytes = sizeof(float) * (size_t)paddedCount(this->max_capacity > 0 ? this->max_capacity : 1);
+    if (use_huge_pages)
+        mapped_bytes = (mapped_bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+    bool ok = true;
+    for (int k = 0; k < ATTRIBUTE_COUNT + 3 && ok; k++) {
+        bool huge = false;
+        void *ptr = mapArray(mapped_bytes, use_huge_pages, huge);
+        huge_pages = huge_pages && huge;
+        if (k < ATTRIBUTE_COUNT)
+            *arrays[k] = static_cast<float *>(ptr);
+        else if (k == ATTRIBUTE_COUNT)
+            ids = static_cast<int *>(ptr);
+        else if (k == ATTRIBUTE_COUNT + 1)
+            slot_of = static_cast<int *>(ptr);
+        else
+            generation = static_cast<unsigned int *>(ptr); // fresh pages read as zero
+        ok = ptr != NULL;
+    }
+    if (!ok) {
+        std::cout << "ERROR::PARTICLE_STORE::ALLOCATION_FAILED for " << this->max_capacity << " particles" << std::endl;
+        this->capacity = 0;
+        this->max_capacity = 0;
+        return;
+    }
+
+    initSlots(0, capacity);
+}
+
+ParticleStore::~ParticleStore()
+{
+    for (int k = 0; k < ATTRIBUTE_COUNT; k++) {
+        if (*arrays[k] != NULL)
+            munmap(*arrays[k], mapped_bytes);
+    }
+    if (ids != NULL)
+        munmap(ids, mapped_bytes);
+    if (slot_of != NULL)
+        munmap(slot_of, mapped_bytes);
+    if (generation != NULL)
+        munmap(generation, mapped_bytes);
+}
+
+void ParticleStore::initSlots(int from, int to)
+{
+    // every slot starts dead, and free ids sit in the slots past alive_count
+    for (int i = from; i < to; i++) {
+        life[i] = -1.0f;
+        ids[i] = i;
+        slot_of[i] = i;
+    }
+}
+
+bool ParticleStore::reserve(int count)
+{
+    if (count <= capacity)
+        return true;
+    if (count > max_capacity)
+        return false;
+
+    int chunk = capacity / 2 > GROWTH_CHUNK ? capacity / 2 : GROWTH_CHUNK;
+    int grown = capacity + chunk;
+    if (grown < count)
+        grown = count;
+    if (grown > max_capacity)
+        grown = max_capacity;
+    initSlots(capacity, grown);
+    capacity = grown;
+    return true;
+}
+
+int ParticleStore::spawn()
+{
+    if (alive_count >= capacity && !reserve(alive_count + 1))
+        return -1;
+    return alive_count++;
+}
+
+int ParticleStore::spawnBlock(int count, int *first)
+{
+    if (alive_count + count > capacity && !reserve(alive_count + count))
+        reserve(max_capacity);
+    int claimed = count < capacity - alive_count ? count : capacity - alive_count;
+    if (claimed < 0)
+        claimed = 0;
+    *first = alive_count;
+    alive_count += claimed;
+    return claimed;
+}
+
+void ParticleStore::kill(int slot)
+{
+    if (slot < sleep_count) {
+        // close the gap inside the sleeping range first
+        swapSlots(slot, sleep_count - 1);
+        slot = --sleep_count;
+    }
+
+    int last = --alive_count;
+    int dead_id = ids[slot];
+    if (slot != last) {
+        for (int k = 0; k < ATTRIBUTE_COUNT; k++) {
+            float *array = *arrays[k];
+            array[slot] = array[last];
+        }
+        ids[slot] = ids[last];
+        slot_of[ids[slot]] = slot;
+    }
+    // the freed id is parked in the vacated slot, ready for the next spawn,
+    // and handles to its old particle go stale
+    generation[dead_id]++;
+    ids[last] = dead_id;
+    slot_of[dead_id] = last;
+    life[last] = -1.0f;
+    rest[last] = 0.0f;
+}
+
+void ParticleStore::sleep(int slot)
+{
+    swapSlots(slot, sleep_count++);
+}
+
+void ParticleStore::wake(int slot)
+{
+    swapSlots(slot, --sleep_count);
+}
+
+void ParticleStore::swapSlots(int a, int b)
+{
+    if (a == b)
+        return;
+    for (int k = 0; k < ATTRIBUTE_COUNT; k++) {
+        float *array = *arrays[k];
+        float held = array[a];
+        array[a] = array[b];
+        array[b] = held;
+    }
+    int held_id = ids[a];
+    ids[a] = ids[b];
+    ids[b] = held_id;
+    slot_of[ids[a]] = a;
+    slot_of[ids[b]] = b;
+}
+
+void ParticleStore::removeDead(const int *slots, int count)
+{
+    // walking the list backwards means every dead slot above the current one is
+    // already gone, so the particle moved down from the end is always alive
+    for (int i = count - 1; i >= 0; i--)
+        kill(slots[i]);
+}
+
+int64_t ParticleStore::handle(int slot) const
+{
+    // 31 bits of generation keep every handle positive, so -1 stays free
+    int id = ids[slot];
+    return (int64_t)(generation[id] & 0x7fffffff) << 32 | id;
+}
+
+int ParticleStore::slotOf(int64_t handle) const
+{
+    if (handle < 0)
+        return -1;
+    int id = (int)(handle & 0xffffffff);
+    if (id < 0 || id >= capacity || (generation[id] & 0x7fffffff) != (handle >> 32) || slot_of[id] >= alive_count)
+        return -1;
+    return slot_of[id];
+}
+
+bool ParticleStore::isAlive(int64_t handle) const
+{
+    return slotOf(handle) >= 0;
+}
+
+void ParticleStore::permute(const int *order, int count)
+{
+    if (count <= 0)
+        return;
+
+    std::vector<float> scratch(count);
+    for (int k = 0; k < ATTRIBUTE_COUNT; k++) {
+        float *array = *arrays[k];
+        for (int i = 0; i < count; i++)
+            scratch[i] = array[order[i]];
+        std::memcpy(array, &scratch[0], sizeof(float) * count);
+    }
+
+    // ids travel with their particles
+    std::vector<int> moved_ids(count);
+    for (int i = 0; i < count; i++)
+        moved_ids[i] = ids[order[i]];
+    for (int i = 0; i < count; i++) {
+        ids[i] = moved_ids[i];
+        slot_of[ids[i]] = i;
+    }
+}
+
+void ParticleStore::permute(ThreadPool &pool, const int *order, int count)
+{
+    if (count <= 0)
+        return;
+
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    std::vector<float> scratch(count);
+    for (int k = 0; k < ATTRIBUTE_COUNT; k++) {
+        float *array = *arrays[k];
+        pool.run(chunks, [&](int c) {
+            for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++)
+                scratch[i] = array[order[i]];
+        });
+        pool.run(chunks, [&](int c) {
+            int begin = c * chunk, end = std::min(count, begin + chunk);
+            std::memcpy(array + begin, &scratch[begin], sizeof(float) * (end - begin));
+        });
+    }
+
+    // ids travel with their particles; every id is in one slot, so the
+    // slot_of writes never meet
+    std::vector<int> moved_ids(count);
+    pool.run(chunks, [&](int c) {
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++)
+            moved_ids[i] = ids[order[i]];
+    });
+    pool.run(chunks, [&](int c) {
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            ids[i] = moved_ids[i];
+            slot_of[ids[i]] = i;
+        }
+    });
+}
+
+bool verifyParticleStore()
+{
+    ParticleStore particles(8);
+    int64_t handles[4];
+    for (int i = 0; i < 4; i++)
+        handles[i] = particles.handle(particles.spawn());
+
+    // the freed id goes to the next spawn, moving the last particle on the way
+    int freed = particles.slotOf(handles[1]);
+    particles.kill(freed);
+    int64_t reused = particles.handle(particles.spawn());
+    if ((reused & 0xffffffff) != (handles[1] & 0xffffffff) || reused == handles[1])
+        return false;
+    if (particles.isAlive(handles[1]) || particles.slotOf(handles[1]) != -1 || !particles.isAlive(reused))
+        return false;
+    for (int i = 0; i < 4; i++) {
+        if (i != 1 && (!particles.isAlive(handles[i]) || particles.ids[particles.slotOf(handles[i])] != (int)(handles[i] & 0xffffffff)))
+            return false;
+    }
+    // nor may a handle that was never given out, e.g. one whose low word
+    // reads as a negative id
+    return !particles.isAlive(-1) && !particles.isAlive(7) && !particles.isAlive(0xfffffffbll)
+        && particles.slotOf(0x80000000ll) == -1;
+}
@@ -0,0 +1,116 @@
+#ifndef PARTICLE_STORE_H
+#define PARTICLE_STORE_H
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "thread_pool.h"
+
+// Structure-of-arrays storage for the particle pool.
+// The update loop only reads and writes position, velocity and life, so those
+// live in their own arrays and a cache line pulled in by the loop holds 16
+// useful floats instead of a quarter of a Square.
+// Live particles are always packed into [0, alive_count): spawning appends at
+// the end and killing moves the last live particle into the freed slot.
+// Because slots move, each particle also carries a stable id; ids and slot_of
+// form a sparse set, so ids[0, alive_count) is the list of live particles and
+// slot_of[id] finds one of them in O(1).
+// Ids are reused once their particle dies, so callers hold a handle instead:
+// the id together with its generation, which kill() bumps. A handle outlives
+// its particle without ever naming the next one to get the same id.
+// The live range itself is split in two: particles that have come to rest
+// sleep in [0, sleep_count) and the update kernels only run over the awake
+// ones in [sleep_count, alive_count). Spawning and killing keep that order.
+// Every array is one mmap of address space for max_capacity slots, of which
+// only the first capacity are in use. Growing touches more of the range
+// instead of reallocating, so pointers into the store stay valid.
+class ParticleStore
+{
+public:
+    // hot attributes, touched every frame
+    float *pos_x, *pos_y, *pos_z;
+    float *vel_x, *vel_y, *vel_z;
+    float *life; // Remaining life of the particle. if < 0 : dead and unused.
+
+    // cold attributes, written at spawn time
+    float *weight; // mass, for mutual gravity
+    float *rest;   // seconds the particle has been nearly still
+
+    // id of the particle in each slot, and the slot currently holding each id
+    int *ids;
+    int *slot_of;
+    // times each id has been freed, by id
+    unsigned int *generation;
+
+    // number of slots in every array
+    int capacity;
+    // capacity can grow up to this without moving any array
+    int max_capacity;
+    // true when the arrays are backed by explicit huge pages rather than
+    // regular pages with transparent huge page advice
+    bool huge_pages;
+    // live particles occupy slots [0, alive_count)
+    int alive_count;
+    // the first sleep_count of them are asleep
+    int sleep_count;
+
+    // every array is 64 byte aligned and padded up to a multiple of this many floats,
+    // so vector loops may always run in full-width steps
+    static const int PADDING = 16;
+    // smallest number of slots added when the pool grows
+    static const int GROWTH_CHUNK = 65536;
+
+    // max_capacity = 0 fixes the pool at capacity. with use_huge_pages the arrays
+    // are mapped with MAP_HUGETLB where available, falling back to regular pages
+    ParticleStore(int capacity, int max_capacity = 0, bool use_huge_pages = false);
+    ~ParticleStore();
+
+    // claims the next free slot and returns its index, or -1 if the pool is full
+    int spawn();
+    // claims up to count slots in one block starting at *first; returns how many
+    // were claimed, fewer than count when the pool runs out
+    int spawnBlock(int count, int *first);
+    // makes at least count slots usable, growing in chunks of GROWTH_CHUNK or
+    // half the current capacity; false if that would pass max_capacity
+    bool reserve(int count);
+    // frees a live slot; the last live particle is moved into it, or for a
+    // sleeping slot the last sleeper, whose place goes to the last live particle
+    void kill(int slot);
+    // frees every slot in an ascending list, in O(count)
+    void removeDead(const int *slots, int count);
+    // moves an awake particle to the end of the sleeping range
+    void sleep(int slot);
+    // moves a sleeping particle to the start of the awake range
+    void wake(int slot);
+    // exchanges everything held in two slots, ids included
+    void swapSlots(int a, int b);
+    // handle of the particle in a live slot
+    int64_t handle(int slot) const;
+    // slot of the particle a handle was given for, or -1 once it has died
+    int slotOf(int64_t handle) const;
+    // true while the particle that was given this handle is still alive
+    bool isAlive(int64_t handle) const;
+
+    // reorders every attribute so that slot i receives the old slot order[i]
+    void permute(const int *order, int count);
+    // the same, split across the pool: attribute by attribute, each gathered
+    // in chunks
+    void permute(ThreadPool &pool, const int *order, int count);
+
+private:
+    ParticleStore(const ParticleStore &);
+    ParticleStore &operator=(const ParticleStore &);
+
+    static const int ATTRIBUTE_COUNT = 9;
+    float **arrays[ATTRIBUTE_COUNT];
+    size_t mapped_bytes;
+
+    // marks slots [from, to) free and gives them their ids
+    void initSlots(int from, int to);
+};
+
+// a handle must stop resolving once its particle dies, even after the id has
+// gone to a new particle
+bool verifyParticleStore();
+
+#endif
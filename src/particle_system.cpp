@@ -0,0 +1,438 @@
+#include "particle_system.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "particle_update.h"
+
+ParticleSystem::ParticleSystem(int capacity, int threads, int max_capacity, bool huge_pages)
+    : particles(capacity, max_capacity, huge_pages), pool(threads), kernel(selectIntegrateKernel()), timestep(1.0f / 60.0f),
+      gravity(0.0f, -9.81f, 0.0f), drag(0.0f), collider(NULL), sleep_speed(0.1f), sleep_after(0.25f),
+      build_grid(false), fluid(false), mutual_gravity(MUTUAL_GRAVITY_NONE),
+      profiler(NULL), spawn_phase(-1), update_phase(-1),
+      render_positions(3 * (size_t)particles.capacity), dead_slots(particles.capacity), render_count(0),
+      settled_gravity(gravity)
+{
+    collision.radius = 0.02f;
+    collision.restitution = 0.3f;
+    collision.friction = 0.1f;
+    gravitation.constant = 1.0f;
+    gravitation.softening = 0.05f;
+
+    Emitter fountain;
+    fountain.position = glm::vec3(9.0f, 1.5f, 0.0f);
+    fountain.velocity = glm::vec3(5.0f, 1.0f, 0.0f);
+    fountain.velocity_spread = 1.5f;
+    fountain.life_min = fountain.life_max = 5.0f;
+    fountain.rate = 10000.0f;
+    emitters.push_back(fountain);
+}
+
+void ParticleSystem::seed(uint64_t seed)
+{
+    rng.seed(seed);
+}
+
+int64_t ParticleSystem::spawn(const glm::vec3 &position, const glm::vec3 &velocity, float life)
+{
+    int slot = particles.spawn();
+    if (slot < 0)
+        return -1;
+
+    particles.life[slot] = life;
+    particles.pos_x[slot] = position.x;
+    particles.pos_y[slot] = position.y;
+    particles.pos_z[slot] = position.z;
+    particles.vel_x[slot] = velocity.x;
+    particles.vel_y[slot] = velocity.y;
+    particles.vel_z[slot] = velocity.z;
+    particles.weight[slot] = 1.0f;
+    blocks.restart(particles, slot, 1);
+    fitBuffers();
+    return particles.handle(slot);
+}
+
+int ParticleSystem::addEmitter(const Emitter &emitter)
+{
+    emitters.push_back(emitter);
+    return (int)emitters.size() - 1;
+}
+
+void ParticleSystem::pour(const glm::vec3 &center, float radius, float speed, float life)
+{
+    float spacing = std::cbrt(sph.params.mass / sph.params.rest_density);
+    Emitter stream;
+    stream.shape = EMITTER_DISK;
+    stream.position = center;
+    stream.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+    stream.radius = radius;
+    stream.speed_min = stream.speed_max = speed;
+    stream.velocity_spread = 0.0f;
+    stream.life_min = stream.life_max = life;
+    // the volume leaving the disk every second, one particle per spacing^3
+    stream.rate = 3.14159265f * radius * radius * speed / (spacing * spacing * spacing);
+    emitters.assign(1, stream);
+    collision.radius = 0.5f * spacing;
+    timestep.step = SPH_STEP;
+    fluid = true;
+}
+
+int ParticleSystem::spawnGalaxy(int count, const glm::vec3 &center, float radius, float mass)
+{
+    int first = 0;
+    count = particles.spawnBlock(count, &first);
+    fitBuffers();
+    if (count <= 0)
+        return 0;
+
+    // surface density exp(-r / scale) out to radius, 3 scales out. the mass
+    // inside r is mass * enclosed(r / scale) / enclosed(3), enclosed(x) =
+    // 1 - (1 + x) e^-x, and r is where that meets a uniform draw
+    const float scale = radius / 3.0f;
+    const float edge_mass = 1.0f - 4.0f * std::exp(-3.0f);
+    const float thickness = 0.02f * radius;
+    const float star_mass = mass / (float)count;
+    emit_scratch.resize(3 * (size_t)count);
+    rng.fillSymmetric(emit_scratch.data(), 3 * count);
+    const float *s = emit_scratch.data();
+    for (int i = 0; i < count; i++) {
+        const float *u = s + 3 * (size_t)i;
+        float target = edge_mass * 0.5f * (u[0] + 1.0f);
+        float low = 0.0f, high = 3.0f;
+        for (int k = 0; k < 20; k++) {
+            float mid = 0.5f * (low + high);
+            if (1.0f - (1.0f + mid) * std::exp(-mid) < target)
+                low = mid;
+            else
+                high = mid;
+        }
+        float r = 0.5f * (low + high) * scale;
+        float phi = 3.14159265f * u[1];
+        float x = r * std::cos(phi), z = r * std::sin(phi);
+        // the disk inside r pulls about like the same mass at the centre
+        float x_scale = r / scale;
+        float inside = mass * (1.0f - (1.0f + x_scale) * std::exp(-x_scale)) / edge_mass;
+        float soft2 = r * r + gravitation.softening * gravitation.softening;
+        float speed = std::sqrt(gravitation.constant * inside * r * r / (soft2 * std::sqrt(soft2)));
+        int slot = first + i;
+        particles.pos_x[slot] = center.x + x;
+        particles.pos_y[slot] = center.y + thickness * u[2];
+        particles.pos_z[slot] = center.z + z;
+        // counter-clockwise seen from above
+        particles.vel_x[slot] = speed * z / std::max(r, 1e-6f);
+        particles.vel_y[slot] = 0.0f;
+        particles.vel_z[slot] = -speed * x / std::max(r, 1e-6f);
+        particles.life[slot] = 1e30f;
+        particles.weight[slot] = star_mass;
+    }
+
+    blocks.restart(particles, first, count);
+    emitters.clear();
+    gravity = glm::vec3(0.0f);
+    sleep_speed = 0.0f;
+    if (mutual_gravity == MUTUAL_GRAVITY_NONE)
+        mutual_gravity = MUTUAL_GRAVITY_BARNES_HUT;
+    return count;
+}
+
+void ParticleSystem::emit(float dt)
+{
+    for (size_t e = 0; e < emitters.size(); e++) {
+        Emitter &emitter = emitters[e];
+        if (!emitter.enabled)
+            continue;
+        int count = emitter.due(dt);
+        if (count <= 0)
+            continue;
+        int first = 0;
+        int claimed = particles.spawnBlock(count, &first);
+        emitter.initialize(particles, first, claimed, rng, emit_scratch);
+        blocks.restart(particles, first, claimed);
+    }
+    fitBuffers();
+}
+
+void ParticleSystem::fitBuffers()
+{
+    if ((int)dead_slots.size() < particles.capacity) {
+        dead_slots.resize(particles.capacity);
+        render_positions.resize(3 * (size_t)particles.capacity);
+    }
+    if (mutual_gravity != MUTUAL_GRAVITY_NONE && (int)accel_x.size() < particles.capacity) {
+        accel_x.resize(particles.capacity);
+        accel_y.resize(particles.capacity);
+        accel_z.resize(particles.capacity);
+    }
+}
+
+IntegrateResult ParticleSystem::step(bool write_positions)
+{
+    {
+        ScopedTimer timer(profiler, spawn_phase);
+        emit(timestep.step);
+    }
+
+    ScopedTimer timer(profiler, update_phase);
+    if (morton.due())
+        sortSpatially();
+    if (gravity != settled_gravity) {
+        // what held the sleepers in place no longer does
+        wakeAll();
+        settled_gravity = gravity;
+    }
+    if (fluid) {
+        grid.cell = sph.params.smoothing;
+        grid.build(pool, particles);
+        sph.apply(pool, particles, grid, timestep.step);
+    }
+    if (mutual_gravity != MUTUAL_GRAVITY_NONE)
+        attract(timestep.step);
+    collideParallel(pool, particles, planes.data(), (int)planes.size(), collider, collision, timestep.step);
+    settle(timestep.step);
+    // after settle(), so particles falling asleep this step still age this step
+    ageSleepers(timestep.step);
+
+    StepParams params = {timestep.step, gravity.x, gravity.y, gravity.z, drag, timestep.outputLag()};
+    float *out = write_positions ? render_positions.data() + 3 * (size_t)particles.sleep_count : NULL;
+    IntegrateResult result = integrateParallel(pool, kernel, particles, params, out, dead_slots.data());
+    particles.removeDead(dead_slots.data(), result.dead);
+    if (write_positions)
+        render_count = particles.sleep_count + result.written;
+    if (build_grid)
+        grid.build(pool, particles);
+    return result;
+}
+
+void ParticleSystem::attract(float dt)
+{
+    fitBuffers();
+    if (mutual_gravity == MUTUAL_GRAVITY_NONE)
+        return;
+
+    if (blocks.select(pool, particles) > 0) {
+        switch (mutual_gravity) {
+        case MUTUAL_GRAVITY_NONE:
+            break;
+        case MUTUAL_GRAVITY_DIRECT:
+            direct_sum.accelerations(pool, particles, gravitation, accel_x.data(), accel_y.data(), accel_z.data(),
+                                     blocks.active.data());
+            break;
+        case MUTUAL_GRAVITY_BARNES_HUT:
+            barnes_hut.build(pool, particles);
+            barnes_hut.accelerations(pool, gravitation, accel_x.data(), accel_y.data(), accel_z.data(),
+                                     blocks.active.data());
+            break;
+        case MUTUAL_GRAVITY_PARTICLE_MESH:
+            // the mesh costs the same whoever is active
+            particle_mesh.accelerations(pool, particles, gravitation, accel_x.data(), accel_y.data(), accel_z.data());
+            break;
+        }
+    }
+    blocks.kick(pool, particles, accel_x.data(), accel_y.data(), accel_z.data(), dt, gravitation.softening);
+}
+
+void ParticleSystem::ageSleepers(float dt)
+{
+    int dead = 0;
+    for (int i = 0; i < particles.sleep_count; i++) {
+        particles.life[i] -= dt;
+        if (!(particles.life[i] > 0.0f))
+            dead_slots[dead++] = i;
+    }
+    for (int d = dead - 1; d >= 0; d--) {
+        int slot = dead_slots[d];
+        particles.kill(slot);
+        if (slot < particles.sleep_count)
+            showSleeper(slot);
+    }
+}
+
+void ParticleSystem::settle(float dt)
+{
+    if (!(sleep_speed > 0.0f))
+        return;
+
+    const int first = particles.sleep_count;
+    const int count = particles.alive_count - first;
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    const float limit = sleep_speed * sleep_speed;
+
+    settle_slots.resize(std::max((int)settle_slots.size(), chunks));
+    pool.run(chunks, [&](int c) {
+        int begin = first + c * chunk;
+        int end = std::min(first + count, begin + chunk);
+        std::vector<int> &ready = settle_slots[c];
+        ready.clear();
+        for (int i = begin; i < end; i++) {
+            float vx = particles.vel_x[i], vy = particles.vel_y[i], vz = particles.vel_z[i];
+            particles.rest[i] = vx * vx + vy * vy + vz * vz < limit ? particles.rest[i] + dt : 0.0f;
+            if (particles.rest[i] >= sleep_after)
+                ready.push_back(i);
+        }
+    });
+
+    // ascending, so a slot swapped into place is never one still to be moved
+    for (int c = 0; c < chunks; c++) {
+        for (size_t k = 0; k < settle_slots[c].size(); k++) {
+            particles.sleep(settle_slots[c][k]);
+            int slot = particles.sleep_count - 1;
+            particles.vel_x[slot] = 0.0f;
+            particles.vel_y[slot] = 0.0f;
+            particles.vel_z[slot] = 0.0f;
+            showSleeper(slot);
+        }
+    }
+}
+
+void ParticleSystem::showSleeper(int slot)
+{
+    float *out = render_positions.data() + 3 * (size_t)slot;
+    out[0] = particles.pos_x[slot];
+    out[1] = particles.pos_y[slot];
+    out[2] = particles.pos_z[slot];
+}
+
+void ParticleSystem::wakeAll()
+{
+    for (int i = 0; i < particles.sleep_count; i++)
+        particles.rest[i] = 0.0f;
+    particles.sleep_count = 0;
+}
+
+void ParticleSystem::wakeInside(const glm::vec3 &low, const glm::vec3 &high)
+{
+    // descending, so the sleeper swapped into a woken slot has been checked
+    for (int i = particles.sleep_count - 1; i >= 0; i--) {
+        if (particles.pos_x[i] < low.x || particles.pos_x[i] > high.x ||
+            particles.pos_y[i] < low.y || particles.pos_y[i] > high.y ||
+            particles.pos_z[i] < low.z || particles.pos_z[i] > high.z)
+            continue;
+        particles.rest[i] = 0.0f;
+        particles.wake(i);
+        if (i < particles.sleep_count)
+            showSleeper(i);
+    }
+}
+
+int ParticleSystem::update(float frame_time)
+{
+    int steps = timestep.advance(frame_time);
+    for (int s = 0; s < steps; s++) {
+        // only the last step of the frame feeds the renderer
+        step(s == steps - 1);
+    }
+    if (steps == 0) {
+        // no step due yet, but the interpolated positions still move on
+        ScopedTimer timer(profiler, update_phase);
+        float *awake_out = render_positions.data() + 3 * (size_t)particles.sleep_count;
+        render_count = particles.sleep_count + writePositionsParallel(pool, particles, timestep.outputLag(), awake_out);
+    }
+    return steps;
+}
+
+int ParticleSystem::prewarm(float seconds)
+{
+    if (seconds < 0.0f) {
+        // after one full lifetime every particle alive was born during the prewarm
+        seconds = 0.0f;
+        for (size_t e = 0; e < emitters.size(); e++) {
+            if (emitters[e].enabled)
+                seconds = std::max(seconds, emitters[e].life_max);
+        }
+    }
+
+    int steps = (int)std::ceil(seconds / timestep.step);
+    for (int s = 0; s < steps; s++)
+        step(s == steps - 1);
+    return steps;
+}
+
+int ParticleSystem::aliveCount() const
+{
+    return particles.alive_count;
+}
+
+int ParticleSystem::sleepingCount() const
+{
+    return particles.sleep_count;
+}
+
+bool ParticleSystem::isAlive(int64_t handle) const
+{
+    return particles.isAlive(handle);
+}
+
+glm::vec3 ParticleSystem::position(int64_t handle) const
+{
+    int slot = particles.slotOf(handle);
+    if (slot < 0)
+        return glm::vec3(0.0f);
+    return glm::vec3(particles.pos_x[slot], particles.pos_y[slot], particles.pos_z[slot]);
+}
+
+glm::vec3 ParticleSystem::velocity(int64_t handle) const
+{
+    int slot = particles.slotOf(handle);
+    if (slot < 0)
+        return glm::vec3(0.0f);
+    return glm::vec3(particles.vel_x[slot], particles.vel_y[slot], particles.vel_z[slot]);
+}
+
+const float *ParticleSystem::positions() const
+{
+    return render_positions.data();
+}
+
+int ParticleSystem::sortPositions(const glm::vec3 &eye, const glm::vec3 &forward)
+{
+    if (sorted_positions.size() < 3 * (size_t)particles.alive_count)
+        sorted_positions.resize(3 * (size_t)particles.capacity);
+    const float eye_xyz[3] = {eye.x, eye.y, eye.z};
+    const float forward_xyz[3] = {forward.x, forward.y, forward.z};
+    return depth_sort.sort(pool, particles, timestep.outputLag(), eye_xyz, forward_xyz, sorted_positions.data());
+}
+
+const float *ParticleSystem::sortedPositions() const
+{
+    return sorted_positions.data();
+}
+
+int ParticleSystem::positionCount() const
+{
+    return render_count;
+}
+
+unsigned long long ParticleSystem::stateHash() const
+{
+    // FNV-1a over the live range of every simulated attribute
+    const float *arrays[] = {particles.pos_x, particles.pos_y, particles.pos_z,
+                             particles.vel_x, particles.vel_y, particles.vel_z, particles.life};
+    unsigned long long hash = 1469598103934665603ull;
+    for (size_t a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++) {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(arrays[a]);
+        for (size_t i = 0; i < sizeof(float) * particles.alive_count; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void ParticleSystem::setProfiler(FrameProfiler *frame_profiler)
+{
+    profiler = frame_profiler;
+    if (profiler != NULL) {
+        spawn_phase = profiler->phase("spawn");
+        update_phase = profiler->phase("update");
+    }
+}
+
+void ParticleSystem::sortSpatially()
+{
+    morton.sort(pool, particles);
+    morton.age = 0;
+    for (int i = 0; i < particles.sleep_count; i++)
+        showSleeper(i);
+    // the grid holds slots
+    if (build_grid)
+        grid.build(pool, particles);
+}
@@ -0,0 +1,184 @@
+#ifndef PARTICLE_SYSTEM_H
+#define PARTICLE_SYSTEM_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+#include "barnes_hut.h"
+#include "block_timestep.h"
+#include "depth_sort.h"
+#include "direct_sum.h"
+#include "emitter.h"
+#include "fixed_timestep.h"
+#include "frame_profiler.h"
+#include "gravity.h"
+#include "morton_order.h"
+#include "particle_collision.h"
+#include "particle_kernels.h"
+#include "particle_mesh.h"
+#include "particle_store.h"
+#include "random.h"
+#include "spatial_grid.h"
+#include "sph.h"
+#include "thread_pool.h"
+
+// how the particles attract each other, if at all
+enum MutualGravity {
+    MUTUAL_GRAVITY_NONE,
+    MUTUAL_GRAVITY_DIRECT,          // every pair, see DirectSum
+    MUTUAL_GRAVITY_BARNES_HUT,      // octree, see BarnesHut
+    MUTUAL_GRAVITY_PARTICLE_MESH    // FFT on a mesh, see ParticleMesh
+};
+
+// The whole particle simulation, independent of any window or GL context.
+// update() consumes real frame time in fixed steps, running every emitter
+// and integrating every step, and leaves the interpolated positions of the
+// live particles in positions() for whoever draws or inspects them.
+class ParticleSystem
+{
+public:
+    ParticleStore particles;
+    ThreadPool pool;
+    IntegrateKernel kernel;
+    FixedTimestep timestep;
+    glm::vec3 gravity;
+    // fraction of its velocity a particle loses per second to the air
+    float drag;
+
+    // sources run every step, in order; starts with the teapot fountain
+    std::vector<Emitter> emitters;
+    // surfaces the particles bounce off every step: the planes, then the
+    // field unless it is NULL (not owned)
+    std::vector<CollisionPlane> planes;
+    const DistanceField *collider;
+    CollisionParams collision;
+    // particles slower than sleep_speed for sleep_after seconds fall asleep and
+    // cost next to nothing until woken; sleep_speed = 0 keeps everyone awake.
+    // sleepers wake when gravity changes or through wakeAll() / wakeInside()
+    float sleep_speed;
+    float sleep_after;
+    // neighbour index over the live particles, rebuilt at the end of every
+    // step while build_grid is set
+    SpatialGrid grid;
+    bool build_grid;
+    // while fluid is set the particles are SPH water: every step rebuilds the
+    // grid with cells of sph.params.smoothing before collision and applies the
+    // fluid forces to the awake particles
+    SphFluid sph;
+    bool fluid;
+    // every particle pulls on every other by its weight, on top of gravity:
+    // the awake particles are kicked by the attraction of all the live ones,
+    // found with the mutual_gravity solver, on the block timesteps of blocks
+    MutualGravity mutual_gravity;
+    GravityParams gravitation;
+    DirectSum direct_sum;
+    BarnesHut barnes_hut;
+    ParticleMesh particle_mesh;
+    BlockTimesteps blocks;
+    // back to front order of positions() for blending, see sortedPositions()
+    DepthSort depth_sort;
+    // resorts the store into Morton order every morton.interval steps, before
+    // the spatial passes of the step; off by default
+    MortonOrder morton;
+    // every random draw of the simulation; the same seed gives the same run bit for bit
+    RandomBatch rng;
+
+    // threads = 0 uses one thread per hardware thread. the pool starts with
+    // room for capacity particles and grows on demand up to max_capacity,
+    // see ParticleStore for huge_pages
+    ParticleSystem(int capacity, int threads = 0, int max_capacity = 0, bool huge_pages = false);
+
+    // restarts the random sequence
+    void seed(uint64_t seed);
+
+    // adds one particle and returns its handle, or -1 if the pool is full
+    int64_t spawn(const glm::vec3 &position, const glm::vec3 &velocity, float life);
+    // adds a source and returns its index in emitters
+    int addEmitter(const Emitter &emitter);
+    // turns fluid on and replaces the emitters with a disk of water of radius
+    // around center pouring down at speed, packed at the rest spacing of sph.
+    // also shortens the step to SPH_STEP, which sph.params are made for
+    void pour(const glm::vec3 &center, float radius, float speed, float life);
+    // adds a disk galaxy of count stars in the xz plane around center, thinning
+    // out exponentially to radius, of total mass, on circular orbits about the
+    // centre. turns on mutual gravity, Barnes-Hut unless a solver is already
+    // chosen, and turns off the emitters, uniform gravity and sleeping. returns the number of stars the pool had room for
+    int spawnGalaxy(int count, const glm::vec3 &center, float radius, float mass);
+    // runs every emitter for dt seconds worth of particles
+    void emit(float dt);
+    // one fixed step: emission, Morton reorder when due, fluid forces, mutual gravity, collision, integration
+    // and removal of the dead.
+    // the positions of the survivors are written only when write_positions is set
+    IntegrateResult step(bool write_positions);
+    // consumes frame_time as whole fixed steps and refreshes positions().
+    // returns the number of steps run
+    int update(float frame_time);
+    // runs fixed steps without rendering until the population has settled, so
+    // the first real frame already sees steady state. seconds < 0 runs for the
+    // longest life any emitter gives out; returns the number of steps run
+    int prewarm(float seconds = -1.0f);
+
+    // live particles
+    int aliveCount() const;
+    int sleepingCount() const;
+    // a handle from spawn() answers for its own particle only; once that dies
+    // isAlive is false and position and velocity are zero
+    bool isAlive(int64_t handle) const;
+    glm::vec3 position(int64_t handle) const;
+    glm::vec3 velocity(int64_t handle) const;
+
+    // interpolated positions of the live particles as packed xyz, as of the last update()
+    const float *positions() const;
+    int positionCount() const;
+    // the same positions back to front: farthest from eye along forward first,
+    // sorted by depth_sort. returns how many there are, the live particles
+    int sortPositions(const glm::vec3 &eye, const glm::vec3 &forward);
+    // as of the last sortPositions()
+    const float *sortedPositions() const;
+
+    // hash of the live particle state, for checking that runs are reproducible
+    unsigned long long stateHash() const;
+
+    // wakes every sleeper, or the ones inside [low, high], e.g. where a
+    // collider has just moved
+    void wakeAll();
+    void wakeInside(const glm::vec3 &low, const glm::vec3 &high);
+
+    // sorts the live particles into Morton order now, see MortonOrder
+    void sortSpatially();
+
+    // records the spawn and update phases of every step into profiler; NULL stops it
+    void setProfiler(FrameProfiler *profiler);
+
+private:
+    ParticleSystem(const ParticleSystem &);
+    ParticleSystem &operator=(const ParticleSystem &);
+
+    FrameProfiler *profiler;
+    int spawn_phase;
+    int update_phase;
+
+    std::vector<float> render_positions;
+    std::vector<float> sorted_positions;
+    std::vector<int> dead_slots;
+    int render_count;
+    std::vector<float> emit_scratch;
+    glm::vec3 settled_gravity;     // gravity the sleepers came to rest under
+    std::vector<std::vector<int> > settle_slots;
+    std::vector<float> accel_x, accel_y, accel_z;   // mutual gravity, by slot
+
+    // keeps the per-slot buffers as large as the pool after it grows
+    void fitBuffers();
+    // kicks the awake particles whose block ends this step by mutual gravity
+    void attract(float dt);
+    // sleepers age like everyone else, and some die
+    void ageSleepers(float dt);
+    // puts the particles that have been still long enough to sleep
+    void settle(float dt);
+    // the positions of the sleepers lead positions() and only change when the
+    // sleeper in a slot does
+    void showSleeper(int slot);
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "particle_update.h"
+
+#include <algorithm>
+#include <vector>
+
+int updateChunkSize(const ThreadPool &pool, int count)
+{
+    // a few chunks per thread evens out the load, and chunk starts stay on
+    // vector boundaries so only the last chunk has a scalar tail
+    int chunk = (count + pool.size() * 4 - 1) / (pool.size() * 4);
+    chunk = std::max(chunk, UPDATE_MIN_CHUNK);
+    return (chunk + ParticleStore::PADDING - 1) / ParticleStore::PADDING * ParticleStore::PADDING;
+}
+
+IntegrateResult integrateParallel(ThreadPool &pool, const IntegrateKernel &kernel, ParticleStore &particles,
+                                  const StepParams &params, float *out, int *dead)
+{
+    const int first = particles.sleep_count;
+    const int count = particles.alive_count - first;
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+
+    if (chunks <= 1)
+        return kernel.run(particles, first, first + count, params, out, dead);
+
+    std::vector<int> survivors(chunks);
+    pool.run(chunks, [&](int c) {
+        int begin = first + c * chunk;
+        int end = std::min(first + count, begin + chunk);
+        survivors[c] = countSurvivors(particles, begin, end, params.dt);
+    });
+
+    // exclusive prefix sums of survivors and of the dead
+    std::vector<int> written_before(chunks);
+    std::vector<int> dead_before(chunks);
+    IntegrateResult total = {0, 0};
+    for (int c = 0; c < chunks; c++) {
+        int size = std::min(count, (c + 1) * chunk) - c * chunk;
+        written_before[c] = total.written;
+        dead_before[c] = total.dead;
+        total.written += survivors[c];
+        total.dead += size - survivors[c];
+    }
+
+    pool.run(chunks, [&](int c) {
+        int begin = first + c * chunk;
+        int end = std::min(first + count, begin + chunk);
+        float *chunk_out = out != NULL ? out + 3 * written_before[c] : NULL;
+        kernel.run(particles, begin, end, params, chunk_out, dead + dead_before[c]);
+    });
+    return total;
+}
+
+int writePositionsParallel(ThreadPool &pool, const ParticleStore &particles, float lag, float *out)
+{
+    const int first = particles.sleep_count;
+    const int count = particles.alive_count - first;
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+
+    pool.run(chunks, [&](int c) {
+        int begin = first + c * chunk;
+        int end = std::min(first + count, begin + chunk);
+        writePositions(particles, begin, end, lag, out + 3 * (begin - first));
+    });
+    return count;
+}
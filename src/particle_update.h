@@ -0,0 +1,25 @@
+#ifndef PARTICLE_UPDATE_H
+#define PARTICLE_UPDATE_H
+
+#include "particle_kernels.h"
+#include "thread_pool.h"
+
+// smallest slice of the live range handed to one task
+const int UPDATE_MIN_CHUNK = 16384;
+
+// slice of a live range of count particles handed to one task: a few per
+// thread, at least UPDATE_MIN_CHUNK, and a multiple of the store padding
+int updateChunkSize(const ThreadPool &pool, int count);
+
+// Runs the kernel over the awake part of the live range, split into chunks
+// across the pool; sleeping particles are left alone.
+// A first pass counts the survivors of every chunk; their prefix sums give each
+// chunk its own window in out and dead, so the kernels write in place without
+// locks and the result is identical, in order, to one serial kernel call.
+IntegrateResult integrateParallel(ThreadPool &pool, const IntegrateKernel &kernel, ParticleStore &particles,
+                                  const StepParams &params, float *out, int *dead);
+
+// writePositions() over the awake particles, split across the pool; returns how many
+int writePositionsParallel(ThreadPool &pool, const ParticleStore &particles, float lag, float *out);
+
+#endif
@@ -0,0 +1,51 @@
+#include "radix_sort.h"
+
+#include <algorithm>
+
+#include "particle_update.h"
+
+void radixSortPairs(ThreadPool &pool, std::vector<unsigned int> &keys, std::vector<int> &values, int key_bits,
+                    RadixSortBuffers &buffers)
+{
+    const int count = (int)keys.size();
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = std::max(1, (count + chunk - 1) / chunk);
+    const int digits = 1 << RADIX_BITS;
+    buffers.key_scratch.resize(count);
+    buffers.value_scratch.resize(count);
+    buffers.histogram.resize((size_t)chunks * digits);
+
+    for (int shift = 0; shift < key_bits; shift += RADIX_BITS) {
+        const unsigned int *in_keys = keys.data();
+        const int *in_values = values.data();
+        unsigned int *out_keys = buffers.key_scratch.data();
+        int *out_values = buffers.value_scratch.data();
+        int *histogram = buffers.histogram.data();
+
+        pool.run(chunks, [&](int c) {
+            int *counts = histogram + (size_t)c * digits;
+            std::fill(counts, counts + digits, 0);
+            for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++)
+                counts[(in_keys[i] >> shift) & (digits - 1)]++;
+        });
+        // digit-major prefix over the chunks, so chunk c writes after chunks < c
+        int running = 0;
+        for (int d = 0; d < digits; d++) {
+            for (int c = 0; c < chunks; c++) {
+                int size = histogram[(size_t)c * digits + d];
+                histogram[(size_t)c * digits + d] = running;
+                running += size;
+            }
+        }
+        pool.run(chunks, [&](int c) {
+            int *next = histogram + (size_t)c * digits;
+            for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+                int j = next[(in_keys[i] >> shift) & (digits - 1)]++;
+                out_keys[j] = in_keys[i];
+                out_values[j] = in_values[i];
+            }
+        });
+        keys.swap(buffers.key_scratch);
+        values.swap(buffers.value_scratch);
+    }
+}
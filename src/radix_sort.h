@@ -0,0 +1,26 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <vector>
+
+#include "thread_pool.h"
+
+// scratch space of radixSortPairs(), kept between sorts so they do not allocate
+struct RadixSortBuffers {
+    std::vector<unsigned int> key_scratch;
+    std::vector<int> value_scratch;
+    std::vector<int> histogram;   // per chunk digit counts of a pass
+};
+
+// bits of the key sorted per pass
+const int RADIX_BITS = 11;
+
+// Sorts the pairs (keys[i], values[i]) by the low key_bits bits of their keys.
+// Every pass is a stable counting sort split into chunks across the pool, each
+// chunk with its own histogram, so there are no atomics and pairs with equal
+// keys keep their order whatever the thread count.
+// keys and values must be the same size; the sorted pairs are left in them.
+void radixSortPairs(ThreadPool &pool, std::vector<unsigned int> &keys, std::vector<int> &values, int key_bits,
+                    RadixSortBuffers &buffers);
+
+#endif
@@ -0,0 +1,185 @@
+#include "random.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static uint64_t splitMix64(uint64_t &state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+// (bits >> 8) is exact as a float and so is the scaling, so the SIMD path
+// rounds identically
+static inline float toSymmetric(uint32_t bits)
+{
+    return (float)(bits >> 8) * (1.0f / 8388608.0f) - 1.0f;
+}
+
+Random::Random(uint64_t seed, uint32_t stream)
+{
+    uint64_t state = seed;
+    uint64_t a = splitMix64(state);
+    uint64_t b = splitMix64(state);
+    s[0] = (uint32_t)a;
+    s[1] = (uint32_t)(a >> 32);
+    s[2] = (uint32_t)b;
+    s[3] = (uint32_t)(b >> 32);
+    for (uint32_t i = 0; i < stream; i++)
+        jump();
+}
+
+uint32_t Random::next()
+{
+    const uint32_t result = s[0] + s[3];
+    const uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+    return result;
+}
+
+float Random::uniform()
+{
+    return (float)(next() >> 8) * (1.0f / 16777216.0f);
+}
+
+float Random::symmetric()
+{
+    return toSymmetric(next());
+}
+
+void Random::jump()
+{
+    static const uint32_t JUMP[] = {0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b};
+    uint32_t j[4] = {0, 0, 0, 0};
+    for (int w = 0; w < 4; w++) {
+        for (int b = 0; b < 32; b++) {
+            if (JUMP[w] & (1u << b)) {
+                for (int k = 0; k < 4; k++)
+                    j[k] ^= s[k];
+            }
+            next();
+        }
+    }
+    for (int k = 0; k < 4; k++)
+        s[k] = j[k];
+}
+
+RandomBatch::RandomBatch(uint64_t seed, uint32_t stream)
+{
+    this->seed(seed, stream);
+}
+
+void RandomBatch::seed(uint64_t seed, uint32_t stream)
+{
+    Random lane(seed, stream * LANES);
+    for (int l = 0; l < LANES; l++) {
+        for (int k = 0; k < 4; k++)
+            s[k][l] = lane.s[k];
+        lane.jump();
+    }
+}
+
+void RandomBatch::next4(uint32_t *out)
+{
+#ifdef __SSE2__
+    __m128i s0 = _mm_load_si128((const __m128i *)s[0]);
+    __m128i s1 = _mm_load_si128((const __m128i *)s[1]);
+    __m128i s2 = _mm_load_si128((const __m128i *)s[2]);
+    __m128i s3 = _mm_load_si128((const __m128i *)s[3]);
+    _mm_storeu_si128((__m128i *)out, _mm_add_epi32(s0, s3));
+    __m128i t = _mm_slli_epi32(s1, 9);
+    s2 = _mm_xor_si128(s2, s0);
+    s3 = _mm_xor_si128(s3, s1);
+    s1 = _mm_xor_si128(s1, s2);
+    s0 = _mm_xor_si128(s0, s3);
+    s2 = _mm_xor_si128(s2, t);
+    s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+    _mm_store_si128((__m128i *)s[0], s0);
+    _mm_store_si128((__m128i *)s[1], s1);
+    _mm_store_si128((__m128i *)s[2], s2);
+    _mm_store_si128((__m128i *)s[3], s3);
+#else
+    // plain lane loops, left to the compiler to vectorize (NEON on arm64)
+    uint32_t t[LANES];
+    for (int l = 0; l < LANES; l++) {
+        out[l] = s[0][l] + s[3][l];
+        t[l] = s[1][l] << 9;
+    }
+    for (int l = 0; l < LANES; l++) {
+        s[2][l] ^= s[0][l];
+        s[3][l] ^= s[1][l];
+        s[1][l] ^= s[2][l];
+        s[0][l] ^= s[3][l];
+        s[2][l] ^= t[l];
+        s[3][l] = rotl(s[3][l], 11);
+    }
+#endif
+}
+
+void RandomBatch::fillSymmetric(float *out, int count)
+{
+    alignas(16) uint32_t bits[LANES];
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(1.0f / 8388608.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (; i + LANES <= count; i += LANES) {
+        next4(bits);
+        __m128i top = _mm_srli_epi32(_mm_load_si128((const __m128i *)bits), 8);
+        __m128 value = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(top), scale), one);
+        _mm_storeu_ps(out + i, value);
+    }
+#endif
+    for (; i < count; i += LANES) {
+        // a partial batch still steps every lane, so the sequence only depends on count
+        next4(bits);
+        for (int l = 0; l < LANES && i + l < count; l++)
+            out[i + l] = toSymmetric(bits[l]);
+    }
+}
+
+void RandomBatch::fillDirections(float *x, float *y, float *z, int count, float spread)
+{
+    fillSymmetric(x, count);
+    fillSymmetric(y, count);
+    fillSymmetric(z, count);
+    for (int i = 0; i < count; i++) {
+        x[i] *= spread;
+        y[i] *= spread;
+        z[i] *= spread;
+    }
+}
+
+bool verifyRandomBatch()
+{
+    const uint64_t seed = 0x5eedull;
+    const uint32_t stream = 3;
+    const int rounds = 1001;
+    RandomBatch batch(seed, stream);
+    Random lanes[RandomBatch::LANES];
+    for (int l = 0; l < RandomBatch::LANES; l++)
+        lanes[l] = Random(seed, stream * RandomBatch::LANES + l);
+
+    float values[RandomBatch::LANES * rounds];
+    batch.fillSymmetric(values, RandomBatch::LANES * rounds);
+    for (int r = 0; r < rounds; r++) {
+        for (int l = 0; l < RandomBatch::LANES; l++) {
+            if (values[r * RandomBatch::LANES + l] != lanes[l].symmetric())
+                return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+// xoshiro128+ generator: 128 bits of state, 32-bit output, period 2^128 - 1.
+// The top bits are the strong ones, so floats are made from the top 24.
+// Streams of one seed are 2^64 draws apart and never overlap, so each thread
+// can own a stream and the results stay reproducible for a given seed.
+class Random
+{
+public:
+    uint32_t s[4];
+
+    explicit Random(uint64_t seed = 1, uint32_t stream = 0);
+
+    uint32_t next();
+    // uniform in [0, 1)
+    float uniform();
+    // uniform in [-1, 1)
+    float symmetric();
+    // advances the generator by 2^64 draws
+    void jump();
+};
+
+// LANES xoshiro128+ generators stepped together with SIMD. Lane l of stream k
+// produces the same sequence as Random(seed, k * LANES + l), so the batch and
+// scalar generators can be checked against each other.
+class RandomBatch
+{
+public:
+    static const int LANES = 4;
+
+    explicit RandomBatch(uint64_t seed = 1, uint32_t stream = 0);
+    void seed(uint64_t seed, uint32_t stream = 0);
+
+    // count values uniform in [-1, 1), taken lane by lane
+    void fillSymmetric(float *out, int count);
+    // count offsets uniform in [-spread, spread) on each axis
+    void fillDirections(float *x, float *y, float *z, int count, float spread);
+
+private:
+    alignas(16) uint32_t s[4][LANES];
+
+    // one step of every lane, four raw outputs
+    void next4(uint32_t *out);
+};
+
+// draws of the batch generator must equal the scalar one lane for lane
+bool verifyRandomBatch();
+
+#endif
@@ -0,0 +1,391 @@
+#include "spatial_grid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "particle_update.h"
+#include "random.h"
+
+// large enough for any real scene, small enough that neighbour cells never overflow
+static const float CELL_LIMIT = 1 << 29;
+
+
+SpatialGrid::SpatialGrid(float cell)
+    : cell(cell), count(0), table_size(0)
+{
+}
+
+int SpatialGrid::cellIndex(float v) const
+{
+    float c = std::floor(v / cell);
+    return (int)std::max(-CELL_LIMIT, std::min(CELL_LIMIT, c));
+}
+
+unsigned int SpatialGrid::bucket(int ix, int iy, int iz) const
+{
+    // rows along x hash to runs of consecutive buckets, so the three cells of
+    // a row next to each other are one range of the sorted particles
+    return (((unsigned int)iy * 19349663u ^ (unsigned int)iz * 83492791u) + (unsigned int)ix) &
+           (unsigned int)(table_size - 1);
+}
+
+void SpatialGrid::build(ThreadPool &pool, const ParticleStore &particles)
+{
+    count = particles.alive_count;
+    table_size = 1024;
+    int table_bits = 10;
+    while (table_size < count) {
+        table_size *= 2;
+        table_bits++;
+    }
+    bucket_of.resize(count);
+    order.resize(count);
+    sorted_x.resize(count);
+    sorted_y.resize(count);
+    sorted_z.resize(count);
+    bucket_start.resize(table_size + 1);
+
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = std::max(1, (count + chunk - 1) / chunk);
+    pool.run(chunks, [&](int c) {
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            bucket_of[i] = bucket(cellIndex(particles.pos_x[i]), cellIndex(particles.pos_y[i]),
+                                  cellIndex(particles.pos_z[i]));
+            order[i] = i;
+        }
+    });
+
+    // stable, and the slots start ascending, so each bucket comes out in slot
+    // order whatever the thread count
+    radixSortPairs(pool, bucket_of, order, table_bits, sort_buffers);
+
+    // each sorted particle that starts a new bucket opens that bucket and
+    // every empty one before it
+    pool.run(chunks, [&](int c) {
+        const unsigned int *sorted = bucket_of.data();
+        for (int j = c * chunk; j < std::min(count, (c + 1) * chunk); j++) {
+            unsigned int previous = j > 0 ? sorted[j - 1] + 1 : 0;
+            for (unsigned int b = previous; b <= sorted[j]; b++)
+                bucket_start[b] = j;
+            sorted_x[j] = particles.pos_x[order[j]];
+            sorted_y[j] = particles.pos_y[order[j]];
+            sorted_z[j] = particles.pos_z[order[j]];
+        }
+    });
+    unsigned int last = count > 0 ? bucket_of[count - 1] + 1 : 0;
+    for (unsigned int b = last; b <= (unsigned int)table_size; b++)
+        bucket_start[b] = count;
+}
+
+int SpatialGrid::neighbourRanges(int ix, int iy, int iz, int begin[18], int end[18]) const
+{
+    const unsigned int mask = (unsigned int)(table_size - 1);
+    int n = 0;
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            unsigned int first = bucket(ix - 1, iy + dy, iz + dz);
+            // a row wrapping around the end of the table is two ranges
+            unsigned int last = std::min(first + 3, mask + 1);
+            unsigned int rest = first + 3 - last;
+            int spans[2][2] = {{bucket_start[first], bucket_start[last]}, {0, bucket_start[rest]}};
+            for (int k = 0; k < 2; k++) {
+                if (spans[k][0] == spans[k][1])
+                    continue;
+                // insertion sorted by start; rows can share buckets, so merge overlaps
+                int at = n;
+                while (at > 0 && begin[at - 1] > spans[k][0])
+                    at--;
+                for (int m = n; m > at; m--) {
+                    begin[m] = begin[m - 1];
+                    end[m] = end[m - 1];
+                }
+                begin[at] = spans[k][0];
+                end[at] = spans[k][1];
+                n++;
+            }
+        }
+    }
+    int merged = 0;
+    for (int k = 0; k < n; k++) {
+        if (merged > 0 && begin[k] <= end[merged - 1]) {
+            end[merged - 1] = std::max(end[merged - 1], end[k]);
+            continue;
+        }
+        begin[merged] = begin[k];
+        end[merged] = end[k];
+        merged++;
+    }
+    return merged;
+}
+
+// appends the slots of the sorted particles [begin, end) within sqrt(r2) of p
+static void gatherWithin(const SpatialGrid &grid, int begin, int end, const glm::vec3 &p, float r2,
+                         std::vector<int> &out)
+{
+    const float *x = grid.sorted_x.data(), *y = grid.sorted_y.data(), *z = grid.sorted_z.data();
+    int j = begin;
+#ifdef __SSE2__
+    const __m128 px = _mm_set1_ps(p.x), py = _mm_set1_ps(p.y), pz = _mm_set1_ps(p.z);
+    const __m128 limit = _mm_set1_ps(r2);
+    for (; j + 4 <= end; j += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), py);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), pz);
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        int mask = _mm_movemask_ps(_mm_cmple_ps(d2, limit));
+        for (; mask != 0; mask &= mask - 1)
+            out.push_back(grid.order[j + __builtin_ctz(mask)]);
+    }
+#endif
+    for (; j < end; j++) {
+        float dx = x[j] - p.x, dy = y[j] - p.y, dz = z[j] - p.z;
+        if (dx * dx + dy * dy + dz * dz <= r2)
+            out.push_back(grid.order[j]);
+    }
+}
+
+int SpatialGrid::radius(const glm::vec3 &p, float r, std::vector<int> &out) const
+{
+    if (count == 0 || r < 0.0f)
+        return 0;
+
+    // two cells can share a bucket, so visit each bucket once
+    std::vector<unsigned int> buckets;
+    int lo_x = cellIndex(p.x - r), lo_y = cellIndex(p.y - r), lo_z = cellIndex(p.z - r);
+    int hi_x = cellIndex(p.x + r), hi_y = cellIndex(p.y + r), hi_z = cellIndex(p.z + r);
+    for (int iz = lo_z; iz <= hi_z; iz++) {
+        for (int iy = lo_y; iy <= hi_y; iy++) {
+            for (int ix = lo_x; ix <= hi_x; ix++)
+                buckets.push_back(bucket(ix, iy, iz));
+        }
+    }
+    std::sort(buckets.begin(), buckets.end());
+    buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+
+    size_t before = out.size();
+    for (size_t k = 0; k < buckets.size(); k++)
+        gatherWithin(*this, bucket_start[buckets[k]], bucket_start[buckets[k] + 1], p, r * r, out);
+    return (int)(out.size() - before);
+}
+
+// the k best so far, kept sorted nearest first
+struct NearestSet {
+    int k, found;
+    int *slots;
+    float *d2;
+    float limit2;
+
+    float worst() const {
+        return found < k ? limit2 : d2[k - 1];
+    }
+
+    void offer(int slot, float distance2) {
+        if (found == k ? !(distance2 < d2[k - 1]) : !(distance2 <= limit2))
+            return;
+        // a bucket shared by two cells can offer the same particle twice
+        for (int i = 0; i < found; i++) {
+            if (slots[i] == slot)
+                return;
+        }
+        int i = found < k ? found++ : k - 1;
+        for (; i > 0 && d2[i - 1] > distance2; i--) {
+            d2[i] = d2[i - 1];
+            slots[i] = slots[i - 1];
+        }
+        d2[i] = distance2;
+        slots[i] = slot;
+    }
+};
+
+static void offerRange(const SpatialGrid &grid, int begin, int end, const glm::vec3 &p, NearestSet &set)
+{
+    const float *x = grid.sorted_x.data(), *y = grid.sorted_y.data(), *z = grid.sorted_z.data();
+    int j = begin;
+#ifdef __SSE2__
+    const __m128 px = _mm_set1_ps(p.x), py = _mm_set1_ps(p.y), pz = _mm_set1_ps(p.z);
+    for (; j + 4 <= end; j += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), py);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), pz);
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        // only the lanes that could make the set go on to the scalar insert
+        int mask = _mm_movemask_ps(_mm_cmple_ps(d2, _mm_set1_ps(set.worst())));
+        if (mask == 0)
+            continue;
+        float lanes[4];
+        _mm_storeu_ps(lanes, d2);
+        for (; mask != 0; mask &= mask - 1) {
+            int lane = __builtin_ctz(mask);
+            set.offer(grid.order[j + lane], lanes[lane]);
+        }
+    }
+#endif
+    for (; j < end; j++) {
+        float dx = x[j] - p.x, dy = y[j] - p.y, dz = z[j] - p.z;
+        set.offer(grid.order[j], dx * dx + dy * dy + dz * dz);
+    }
+}
+
+int SpatialGrid::nearest(const glm::vec3 &p, int k, float max_radius, int *slots, float *distance2) const
+{
+    if (k <= 0 || count == 0)
+        return 0;
+
+    std::vector<float> own_d2;
+    if (distance2 == NULL) {
+        own_d2.resize(k);
+        distance2 = own_d2.data();
+    }
+    NearestSet set = {k, 0, slots, distance2, max_radius * max_radius};
+
+    // grow cube shells around the cell of p. every point outside shell s is at
+    // least s cells away, so once the k-th best is closer than that it is final
+    int cx = cellIndex(p.x), cy = cellIndex(p.y), cz = cellIndex(p.z);
+    for (int s = 0;; s++) {
+        int side = 2 * s + 1;
+        if ((double)side * side * side > table_size) {
+            // the shell covers more cells than there are buckets: scan everything
+            offerRange(*this, 0, count, p, set);
+            break;
+        }
+        for (int dz = -s; dz <= s; dz++) {
+            for (int dy = -s; dy <= s; dy++) {
+                bool face = dz == -s || dz == s || dy == -s || dy == s;
+                for (int dx = -s; dx <= s; dx += face ? 1 : 2 * s) {
+                    unsigned int b = bucket(cx + dx, cy + dy, cz + dz);
+                    offerRange(*this, bucket_start[b], bucket_start[b + 1], p, set);
+                    if (s == 0)
+                        break;
+                }
+            }
+        }
+        float reach = s * cell;
+        if (reach >= max_radius || (set.found == k && set.d2[k - 1] <= reach * reach))
+            break;
+    }
+    return set.found;
+}
+
+void SpatialGrid::radiusBatch(ThreadPool &pool, const float *x, const float *y, const float *z, int queries,
+                              float r, std::vector<int> &offsets, std::vector<int> &neighbours) const
+{
+    const int tasks = std::max(1, std::min(queries, pool.size() * 4));
+    const int per_task = (queries + tasks - 1) / tasks;
+    std::vector<std::vector<int> > found(tasks);
+    offsets.resize(queries + 1);
+
+    // each task gathers its queries on its own, then they are joined in order
+    pool.run(tasks, [&](int t) {
+        for (int q = t * per_task; q < std::min(queries, (t + 1) * per_task); q++)
+            offsets[q + 1] = radius(glm::vec3(x[q], y[q], z[q]), r, found[t]);
+    });
+
+    offsets[0] = 0;
+    for (int q = 0; q < queries; q++)
+        offsets[q + 1] += offsets[q];
+    neighbours.resize(offsets[queries]);
+    pool.run(tasks, [&](int t) {
+        int first = std::min(queries, t * per_task);
+        std::copy(found[t].begin(), found[t].end(), neighbours.begin() + offsets[first]);
+    });
+}
+
+void SpatialGrid::nearestBatch(ThreadPool &pool, const float *x, const float *y, const float *z, int queries,
+                               int k, float max_radius, int *slots, float *distance2) const
+{
+    const int tasks = std::max(1, std::min(queries, pool.size() * 4));
+    const int per_task = (queries + tasks - 1) / tasks;
+    pool.run(tasks, [&](int t) {
+        for (int q = t * per_task; q < std::min(queries, (t + 1) * per_task); q++) {
+            int *out = slots + (size_t)q * k;
+            float *out_d2 = distance2 != NULL ? distance2 + (size_t)q * k : NULL;
+            int n = nearest(glm::vec3(x[q], y[q], z[q]), k, max_radius, out, out_d2);
+            for (int i = n; i < k; i++) {
+                out[i] = -1;
+                if (out_d2 != NULL)
+                    out_d2[i] = -1.0f;
+            }
+        }
+    });
+}
+
+bool verifySpatialGrid()
+{
+    const int count = 20000;
+    const float r = 0.15f;
+    const int k = 8;
+    ParticleStore particles(count);
+    Random random(0x9e1dull);
+    int first = 0;
+    particles.spawnBlock(count, &first);
+    for (int i = 0; i < count; i++) {
+        particles.pos_x[i] = 2.0f * random.uniform();
+        particles.pos_y[i] = 2.0f * random.uniform();
+        particles.pos_z[i] = 2.0f * random.uniform();
+    }
+
+    ThreadPool pool(2);
+    SpatialGrid grid(0.1f);
+    grid.build(pool, particles);
+
+    std::vector<float> qx, qy, qz;
+    for (int q = 0; q < 200; q++) {
+        qx.push_back(2.2f * random.uniform() - 0.1f);
+        qy.push_back(2.2f * random.uniform() - 0.1f);
+        qz.push_back(2.2f * random.uniform() - 0.1f);
+    }
+    std::vector<int> offsets, neighbours;
+    grid.radiusBatch(pool, qx.data(), qy.data(), qz.data(), (int)qx.size(), r, offsets, neighbours);
+    std::vector<int> nearest_slots(qx.size() * k);
+    std::vector<float> nearest_d2(qx.size() * k);
+    grid.nearestBatch(pool, qx.data(), qy.data(), qz.data(), (int)qx.size(), k, 1.0f,
+                      nearest_slots.data(), nearest_d2.data());
+
+    for (size_t q = 0; q < qx.size(); q++) {
+        std::vector<int> expected;
+        std::vector<float> all_d2(count);
+        for (int i = 0; i < count; i++) {
+            float dx = particles.pos_x[i] - qx[q], dy = particles.pos_y[i] - qy[q], dz = particles.pos_z[i] - qz[q];
+            all_d2[i] = dx * dx + dy * dy + dz * dz;
+            if (all_d2[i] <= r * r)
+                expected.push_back(i);
+        }
+        std::vector<int> got(neighbours.begin() + offsets[q], neighbours.begin() + offsets[q + 1]);
+        std::sort(got.begin(), got.end());
+        if (got != expected)
+            return false;
+
+        // the neighbour ranges of the query's cell hold everything within one cell
+        std::vector<int> within_cell, ranged;
+        for (int i = 0; i < count; i++) {
+            if (all_d2[i] <= grid.cell * grid.cell)
+                within_cell.push_back(i);
+        }
+        int begin[18], end[18];
+        int ranges = grid.neighbourRanges(grid.cellIndex(qx[q]), grid.cellIndex(qy[q]), grid.cellIndex(qz[q]),
+                                          begin, end);
+        for (int n = 0; n < ranges; n++) {
+            if (n > 0 && begin[n] < end[n - 1])
+                return false;
+            for (int j = begin[n]; j < end[n]; j++) {
+                if (all_d2[grid.order[j]] <= grid.cell * grid.cell)
+                    ranged.push_back(grid.order[j]);
+            }
+        }
+        std::sort(ranged.begin(), ranged.end());
+        if (ranged != within_cell)
+            return false;
+
+        std::sort(all_d2.begin(), all_d2.end());
+        for (int i = 0; i < k; i++) {
+            if (std::fabs(nearest_d2[q * k + i] - all_d2[i]) > 1e-6f)
+                return false;
+        }
+    }
+    return true;
+}
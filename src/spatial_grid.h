@@ -0,0 +1,65 @@
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+#include "particle_store.h"
+#include "radix_sort.h"
+#include "thread_pool.h"
+
+// Uniform grid over particle positions, rebuilt from scratch rather than
+// updated. Cells are hashed into a table of buckets, so the grid has no bounds;
+// a parallel radix sort then lays the particles out bucket by bucket, with
+// a copy of their positions in that order for the distance tests.
+// Queries return slots of the store the grid was built from, in ascending
+// order within each bucket; they are only valid until the store changes.
+class SpatialGrid
+{
+public:
+    float cell;                    // edge of a grid cell
+    int count;                     // particles indexed
+    int table_size;                // buckets, a power of two
+    std::vector<int> bucket_start; // particles of bucket b are [bucket_start[b], bucket_start[b + 1])
+    std::vector<int> order;        // slot of each indexed particle, in bucket order
+    std::vector<float> sorted_x, sorted_y, sorted_z;
+
+    explicit SpatialGrid(float cell = 0.1f);
+
+    // indexes every live particle, sleepers included
+    void build(ThreadPool &pool, const ParticleStore &particles);
+
+    // slots within radius of p, appended to out; returns how many were added
+    int radius(const glm::vec3 &p, float radius, std::vector<int> &out) const;
+    // up to k slots nearest to p and no further than max_radius, nearest first.
+    // returns how many were found; distance2 may be NULL
+    int nearest(const glm::vec3 &p, int k, float max_radius, int *slots, float *distance2) const;
+
+    // cell along any axis holding coordinate v
+    int cellIndex(float v) const;
+    // the particles of the 27 cells around cell (ix, iy, iz) as disjoint,
+    // ascending ranges [begin, end) of grid order; returns how many. while
+    // cell >= r they hold every particle within r of any point of the middle cell
+    int neighbourRanges(int ix, int iy, int iz, int begin[18], int end[18]) const;
+
+    // radius() for every query point, split across the pool. the neighbours of
+    // query q end up in neighbours[offsets[q], offsets[q + 1])
+    void radiusBatch(ThreadPool &pool, const float *x, const float *y, const float *z, int queries,
+                     float radius, std::vector<int> &offsets, std::vector<int> &neighbours) const;
+    // nearest() for every query point, split across the pool. query q writes
+    // slots[q * k, q * k + k), padded with -1 where fewer were found
+    void nearestBatch(ThreadPool &pool, const float *x, const float *y, const float *z, int queries,
+                      int k, float max_radius, int *slots, float *distance2) const;
+
+private:
+    std::vector<unsigned int> bucket_of; // bucket of each particle, sorted along with order
+    RadixSortBuffers sort_buffers;
+
+    unsigned int bucket(int ix, int iy, int iz) const;
+};
+
+// radius and nearest queries must match a brute force search on random points
+bool verifySpatialGrid();
+
+#endif
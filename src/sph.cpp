@@ -0,0 +1,262 @@
+#include "sph.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "particle_update.h"
+
+static const float PI = 3.14159265358979f;
+
+SphParams sphParamsForSpacing(float spacing, float step)
+{
+    SphParams params;
+    params.smoothing = 2.0f * spacing;
+    params.rest_density = 1000.0f;
+    params.mass = params.rest_density * spacing * spacing * spacing;
+    // the fastest sound a step resolves (CFL 0.4), so the fluid is as
+    // incompressible as the step allows; viscosity damps at the kernel scale
+    float sound_speed = 0.4f * params.smoothing / step;
+    params.stiffness = sound_speed * sound_speed;
+    params.viscosity = 0.1f * params.rest_density * params.smoothing * sound_speed;
+    return params;
+}
+
+SphFluid::SphFluid()
+    : params(sphParamsForSpacing(0.05f, SPH_STEP))
+{
+}
+
+// the particles of the 27 cells around one cell, copied out of grid order so
+// every particle of that cell runs over one contiguous list. the list is padded
+// to a multiple of 4 with particles too far away to count
+struct Candidates {
+    int cell[3];
+    int count;
+    std::vector<float> x, y, z, inv_density, pressure_ratio, vx, vy, vz;
+
+    Candidates() : count(-1) {}
+
+    // sorted holds 1 / density, pressure / density and velocity in grid
+    // order for the force pass; NULL copies positions only
+    void gather(const SpatialGrid &grid, const float *const *sorted, int ix, int iy, int iz)
+    {
+        const bool forces = sorted != NULL;
+        if (count >= 0 && ix == cell[0] && iy == cell[1] && iz == cell[2])
+            return;
+        cell[0] = ix;
+        cell[1] = iy;
+        cell[2] = iz;
+        int begins[18], ends[18];
+        int range_count = grid.neighbourRanges(ix, iy, iz, begins, ends);
+        count = 0;
+        for (int r = 0; r < range_count; r++)
+            count += ends[r] - begins[r];
+        int padded = (count + 3) & ~3;
+        resize(padded, forces);
+
+        int n = 0;
+        for (int r = 0; r < range_count; r++) {
+            int begin = begins[r], end = ends[r];
+            std::copy(grid.sorted_x.begin() + begin, grid.sorted_x.begin() + end, x.begin() + n);
+            std::copy(grid.sorted_y.begin() + begin, grid.sorted_y.begin() + end, y.begin() + n);
+            std::copy(grid.sorted_z.begin() + begin, grid.sorted_z.begin() + end, z.begin() + n);
+            if (forces) {
+                std::copy(sorted[0] + begin, sorted[0] + end, inv_density.begin() + n);
+                std::copy(sorted[1] + begin, sorted[1] + end, pressure_ratio.begin() + n);
+                std::copy(sorted[2] + begin, sorted[2] + end, vx.begin() + n);
+                std::copy(sorted[3] + begin, sorted[3] + end, vy.begin() + n);
+                std::copy(sorted[4] + begin, sorted[4] + end, vz.begin() + n);
+            }
+            n += end - begin;
+        }
+        for (; n < padded; n++) {
+            x[n] = y[n] = z[n] = 1e30f;
+            if (forces)
+                inv_density[n] = pressure_ratio[n] = vx[n] = vy[n] = vz[n] = 0.0f;
+        }
+        count = padded;
+    }
+
+    void resize(int size, bool forces)
+    {
+        if ((int)x.size() >= size && (!forces || (int)inv_density.size() >= size))
+            return;
+        x.resize(size);
+        y.resize(size);
+        z.resize(size);
+        if (forces) {
+            inv_density.resize(size);
+            pressure_ratio.resize(size);
+            vx.resize(size);
+            vy.resize(size);
+            vz.resize(size);
+        }
+    }
+};
+
+// sum of (h^2 - r^2)^3 over the candidates within h of p
+static float densitySum(const Candidates &near, float px, float py, float pz, float h2)
+{
+    float sum = 0.0f;
+#ifdef __SSE2__
+    const __m128 vpx = _mm_set1_ps(px), vpy = _mm_set1_ps(py), vpz = _mm_set1_ps(pz);
+    const __m128 vh2 = _mm_set1_ps(h2);
+    __m128 acc = _mm_setzero_ps();
+    for (int j = 0; j < near.count; j += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&near.x[j]), vpx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&near.y[j]), vpy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&near.z[j]), vpz);
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        // lanes outside the kernel go to zero before cubing
+        __m128 q = _mm_and_ps(_mm_sub_ps(vh2, r2), _mm_cmplt_ps(r2, vh2));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_mul_ps(q, q), q));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+    for (int j = 0; j < near.count; j++) {
+        float dx = near.x[j] - px, dy = near.y[j] - py, dz = near.z[j] - pz;
+        float r2 = dx * dx + dy * dy + dz * dz;
+        if (r2 < h2) {
+            float q = h2 - r2;
+            sum += q * q * q;
+        }
+    }
+#endif
+    return sum;
+}
+
+struct ForceSum {
+    float pressure[3];   // sum of (p_i + p_j) / rho_j (h - r)^2 / r * (x_i - x_j)
+    float viscous[3];    // sum of (v_j - v_i) / rho_j (h - r)
+};
+
+// pressure and viscosity terms on a particle at p, moving at v, from the candidates
+static ForceSum forceSum(const Candidates &near, const float p[3], const float v[3], float pp, float h)
+{
+    const float h2 = h * h;
+    // coincident particles, the particle itself among them, have no direction to push in
+    const float min_r2 = 1e-12f * h2;
+    ForceSum out = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}};
+#ifdef __SSE2__
+    const __m128 vpx = _mm_set1_ps(p[0]), vpy = _mm_set1_ps(p[1]), vpz = _mm_set1_ps(p[2]);
+    const __m128 vvx = _mm_set1_ps(v[0]), vvy = _mm_set1_ps(v[1]), vvz = _mm_set1_ps(v[2]);
+    const __m128 vpp = _mm_set1_ps(pp), vh = _mm_set1_ps(h), vh2 = _mm_set1_ps(h2);
+    const __m128 vmin = _mm_set1_ps(min_r2), half = _mm_set1_ps(0.5f), three_halves = _mm_set1_ps(1.5f);
+    __m128 fx = _mm_setzero_ps(), fy = _mm_setzero_ps(), fz = _mm_setzero_ps();
+    __m128 gx = _mm_setzero_ps(), gy = _mm_setzero_ps(), gz = _mm_setzero_ps();
+    for (int j = 0; j < near.count; j += 4) {
+        __m128 dx = _mm_sub_ps(vpx, _mm_loadu_ps(&near.x[j]));
+        __m128 dy = _mm_sub_ps(vpy, _mm_loadu_ps(&near.y[j]));
+        __m128 dz = _mm_sub_ps(vpz, _mm_loadu_ps(&near.z[j]));
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 inside = _mm_and_ps(_mm_cmplt_ps(r2, vh2), _mm_cmpgt_ps(r2, vmin));
+        if (_mm_movemask_ps(inside) == 0)
+            continue;
+        // lanes outside get r = h, and so no weight. 1 / r is the estimate
+        // of rsqrt refined by one Newton step, which leaves no divisions
+        __m128 r2_in = _mm_or_ps(_mm_and_ps(inside, r2), _mm_andnot_ps(inside, vh2));
+        __m128 inv_r = _mm_rsqrt_ps(r2_in);
+        inv_r = _mm_mul_ps(inv_r, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, r2_in), _mm_mul_ps(inv_r, inv_r))));
+        __m128 w = _mm_sub_ps(vh, _mm_mul_ps(r2_in, inv_r));
+        __m128 inv_rho = _mm_loadu_ps(&near.inv_density[j]);
+        // (p_i + p_j) / rho_j = p_i / rho_j + p_j / rho_j
+        __m128 push = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vpp, inv_rho), _mm_loadu_ps(&near.pressure_ratio[j])),
+                                 _mm_mul_ps(_mm_mul_ps(w, w), inv_r));
+        fx = _mm_add_ps(fx, _mm_mul_ps(push, dx));
+        fy = _mm_add_ps(fy, _mm_mul_ps(push, dy));
+        fz = _mm_add_ps(fz, _mm_mul_ps(push, dz));
+        __m128 drag = _mm_mul_ps(inv_rho, w);
+        gx = _mm_add_ps(gx, _mm_mul_ps(drag, _mm_sub_ps(_mm_loadu_ps(&near.vx[j]), vvx)));
+        gy = _mm_add_ps(gy, _mm_mul_ps(drag, _mm_sub_ps(_mm_loadu_ps(&near.vy[j]), vvy)));
+        gz = _mm_add_ps(gz, _mm_mul_ps(drag, _mm_sub_ps(_mm_loadu_ps(&near.vz[j]), vvz)));
+    }
+    __m128 sums[6] = {fx, fy, fz, gx, gy, gz};
+    float *targets[6] = {&out.pressure[0], &out.pressure[1], &out.pressure[2],
+                         &out.viscous[0], &out.viscous[1], &out.viscous[2]};
+    for (int k = 0; k < 6; k++) {
+        float lanes[4];
+        _mm_storeu_ps(lanes, sums[k]);
+        *targets[k] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+#else
+    for (int j = 0; j < near.count; j++) {
+        float dx = p[0] - near.x[j], dy = p[1] - near.y[j], dz = p[2] - near.z[j];
+        float r2 = dx * dx + dy * dy + dz * dz;
+        if (!(r2 < h2 && r2 > min_r2))
+            continue;
+        float r = std::sqrt(r2);
+        float w = h - r;
+        float push = (pp * near.inv_density[j] + near.pressure_ratio[j]) * w * w / r;
+        out.pressure[0] += push * dx;
+        out.pressure[1] += push * dy;
+        out.pressure[2] += push * dz;
+        float drag = w * near.inv_density[j];
+        out.viscous[0] += drag * (near.vx[j] - v[0]);
+        out.viscous[1] += drag * (near.vy[j] - v[1]);
+        out.viscous[2] += drag * (near.vz[j] - v[2]);
+    }
+#endif
+    return out;
+}
+
+void SphFluid::apply(ThreadPool &pool, ParticleStore &particles, const SpatialGrid &grid, float dt)
+{
+    const int count = grid.count;
+    const float h = params.smoothing;
+    const float poly6 = 315.0f / (64.0f * PI * std::pow(h, 9.0f));
+    const float spiky = 45.0f / (PI * std::pow(h, 6.0f));
+    density.resize(count);
+    pressure.resize(count);
+    sorted_vx.resize(count);
+    sorted_vy.resize(count);
+    sorted_vz.resize(count);
+    inv_density.resize(count);
+    pressure_ratio.resize(count);
+
+    const int chunk = updateChunkSize(pool, count);
+    const int chunks = (count + chunk - 1) / chunk;
+    const int *order = grid.order.data();
+    const float *sorted[5] = {inv_density.data(), pressure_ratio.data(), sorted_vx.data(), sorted_vy.data(),
+                              sorted_vz.data()};
+
+    // particles of one cell are mostly adjacent in grid order, so a task only
+    // gathers the candidates again when the cell changes
+    pool.run(chunks, [&](int c) {
+        Candidates near;
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            float px = grid.sorted_x[i], py = grid.sorted_y[i], pz = grid.sorted_z[i];
+            near.gather(grid, NULL, grid.cellIndex(px), grid.cellIndex(py), grid.cellIndex(pz));
+            density[i] = params.mass * poly6 * densitySum(near, px, py, pz, h * h);
+            pressure[i] = std::max(0.0f, params.stiffness * (density[i] - params.rest_density));
+            inv_density[i] = 1.0f / density[i];
+            pressure_ratio[i] = pressure[i] * inv_density[i];
+            sorted_vx[i] = particles.vel_x[order[i]];
+            sorted_vy[i] = particles.vel_y[order[i]];
+            sorted_vz[i] = particles.vel_z[order[i]];
+        }
+    });
+
+    // a_i = m / rho_i * spiky * (pressure sum / 2 + viscosity * viscous sum)
+    pool.run(chunks, [&](int c) {
+        Candidates near;
+        for (int i = c * chunk; i < std::min(count, (c + 1) * chunk); i++) {
+            int slot = order[i];
+            if (slot < particles.sleep_count)
+                continue;
+            float p[3] = {grid.sorted_x[i], grid.sorted_y[i], grid.sorted_z[i]};
+            float v[3] = {sorted_vx[i], sorted_vy[i], sorted_vz[i]};
+            near.gather(grid, sorted, grid.cellIndex(p[0]), grid.cellIndex(p[1]), grid.cellIndex(p[2]));
+            ForceSum sum = forceSum(near, p, v, pressure[i], h);
+            float scale = dt * params.mass * spiky * inv_density[i];
+            particles.vel_x[slot] += scale * (0.5f * sum.pressure[0] + params.viscosity * sum.viscous[0]);
+            particles.vel_y[slot] += scale * (0.5f * sum.pressure[1] + params.viscosity * sum.viscous[1]);
+            particles.vel_z[slot] += scale * (0.5f * sum.pressure[2] + params.viscosity * sum.viscous[2]);
+        }
+    });
+}
@@ -0,0 +1,57 @@
+#ifndef SPH_H
+#define SPH_H
+
+#include <vector>
+
+#include "particle_store.h"
+#include "spatial_grid.h"
+#include "thread_pool.h"
+
+struct SphParams {
+    float smoothing;     // kernel radius h; the grid cell must be at least this
+    float rest_density;
+    float stiffness;     // pressure per unit of density above rest, the squared speed of sound
+    float viscosity;
+    float mass;          // of every particle
+};
+
+// water falling a few metres lands at about 10 m/s; at 5 cm spacing a 240 Hz
+// step resolves sound that fast, a 60 Hz one only a quarter of it and the
+// water squeezes to several times its rest density where it lands
+const float SPH_STEP = 1.0f / 240.0f;
+
+// rest_density * spacing^3 per particle, with h twice the spacing: about 30
+// neighbours each at rest. stiffness is the most a step of that length stays
+// stable with
+SphParams sphParamsForSpacing(float spacing, float step);
+
+// Smoothed particle hydrodynamics over the particles of a store: density with
+// the poly6 kernel, then pressure (spiky gradient) and viscosity (viscosity
+// laplacian) forces, after Mueller et al. 2003. Pressure is
+// stiffness * (density - rest_density), never below zero so a free surface
+// does not pull together.
+// Both passes walk the particles in the cell order of the grid. The particles
+// of one cell share a copy of everything in the 27 cells around it, so the
+// sums run over one contiguous list, and come out the same whatever the
+// thread count.
+class SphFluid
+{
+public:
+    SphParams params;
+    // per particle in grid order, as of the last apply()
+    std::vector<float> density;
+    std::vector<float> pressure;
+
+    SphFluid();
+
+    // adds dt times the fluid acceleration to the velocity of every awake
+    // particle. grid must have been built from particles as they are now;
+    // sleepers are in it and push on the others, but are not pushed back
+    void apply(ThreadPool &pool, ParticleStore &particles, const SpatialGrid &grid, float dt);
+
+private:
+    std::vector<float> sorted_vx, sorted_vy, sorted_vz;
+    std::vector<float> inv_density, pressure_ratio;   // 1 / density, pressure / density
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int thread_count)
+    : task(NULL), task_count(0), generation(0), busy_workers(0), stopping(false),
+      next_task(0), remaining_tasks(0)
+{
+    if (thread_count <= 0)
+        thread_count = (int)std::thread::hardware_concurrency();
+    if (thread_count <= 0)
+        thread_count = 1;
+
+    for (int i = 1; i < thread_count; i++)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+int ThreadPool::size() const
+{
+    return (int)workers.size() + 1;
+}
+
+void ThreadPool::run(int count, const std::function<void(int)> &batch_task)
+{
+    if (count <= 0)
+        return;
+    if (workers.empty() || count == 1) {
+        for (int i = 0; i < count; i++)
+            batch_task(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &batch_task;
+        task_count = count;
+        next_task.store(0);
+        remaining_tasks.store(count);
+        generation++;
+    }
+    wake.notify_all();
+
+    work(&batch_task, count);
+
+    // wait for the last task and for every worker to leave the batch, so no
+    // straggler can pick up an index of the next one
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return remaining_tasks.load() == 0 && busy_workers == 0; });
+    task = NULL;
+}
+
+void ThreadPool::work(const std::function<void(int)> *batch_task, int batch_count)
+{
+    for (;;) {
+        int i = next_task.fetch_add(1);
+        if (i >= batch_count)
+            return;
+        (*batch_task)(i);
+        if (remaining_tasks.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.notify_all();
+        }
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    unsigned int seen = 0;
+    for (;;) {
+        const std::function<void(int)> *batch_task;
+        int batch_count;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || (generation != seen && task != NULL); });
+            if (stopping)
+                return;
+            seen = generation;
+            batch_task = task;
+            batch_count = task_count;
+            busy_workers++;
+        }
+
+        work(batch_task, batch_count);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy_workers--;
+        }
+        finished.notify_all();
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run batches of indexed tasks.
+// The thread calling run() works on the batch too, so a pool of size 1 has no
+// workers and simply runs everything inline.
+class ThreadPool
+{
+public:
+    // thread_count includes the calling thread; 0 means one per hardware thread
+    explicit ThreadPool(int thread_count = 0);
+    ~ThreadPool();
+
+    // number of threads that take part in run(), including the caller
+    int size() const;
+
+    // calls task(i) for every i in [0, task_count) and returns once all are done
+    void run(int task_count, const std::function<void(int)> &task);
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    void workerLoop();
+    void work(const std::function<void(int)> *batch_task, int batch_count);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    // current batch, guarded by mutex
+    const std::function<void(int)> *task;
+    int task_count;
+    unsigned int generation;
+    int busy_workers;
+    bool stopping;
+
+    std::atomic<int> next_task;
+    std::atomic<int> remaining_tasks;
+};
+
+#endif